@@ -1,7 +1,14 @@
 #include <iostream>
 #include <string>
+#include <span>
 #include <vector>
 #include <filesystem>
+#include <iomanip>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
 
 #include <glad/glad.h>
 
@@ -18,13 +25,16 @@
 #include "rendering/VBO.h"
 #include "rendering/camera.h"
 #include "rendering/mesh.h"
+#include "rendering/rasterizer.h"
 #include "rendering/shader.h"
 
 #include "tree/grid.h"
 #include "tree/skeleton.h"
 #include "tree/strands.h"
 
+#include "util/png.h"
 #include "util/stopwatch.h"
+#include "util/threads.h"
 
 
 //#define SKY_COLOR glm::vec4(0.529,0.808,0.922,1.0)
@@ -46,8 +56,31 @@ GLFWwindow *openGLInit();
 void framebuffer_size_callback(GLFWwindow *window, int w, int h);
 void processInput(GLFWwindow *window);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
+
+// Where a tree's files go and what has been written there so far. The
+// window has one, batch runs make one per tree.
+struct Output {
+    std::string prefix = "tree";
+    // Seconds taken by each STOPWATCH section
+    json timings;
+    int images_taken = 0;
+    int meshes_exported = 0;
+};
+Output output;
+
+void setup_output(const json& opt_data, const std::filesystem::path& dir, Output& out);
+std::vector<Camera> make_cameras(Grid& gr, const json& opt_data);
 void save_image();
-void save_mesh(Mesh<Vertex> mesh);
+void save_pixels(Output& out, std::span<const uint8_t> rgb);
+void render_screenshots(Output& out, const std::vector<Camera>& views,
+        const Mesh<Vertex>& tree_geom, const Mesh<Vertex>& strands_geom);
+void save_mesh(Output& out, Grid& grid, float threshold);
+int convert_skeletons(int argc, char *argv[]);
+int run_headless(json& opt_data, Output& output);
+int run_batch(int argc, char *argv[]);
+void configure_threads(json& opt_data, Output& output);
+int tune_threads(json& opt_data, Output& output, Affinity affinity);
+void apply_fill_mode(Grid& gr, const json& opt_data);
 
 std::vector<Camera> cameras;
 size_t curr_cam = 0;
@@ -58,7 +91,11 @@ void cycle_camera(int dir) {
 }
 #define CAMERA cameras[curr_cam]
 
-std::string image_prefix = "tree";
+#define STOPWATCH(ACTION, ...)                                                 \
+    std::cout << ACTION << "..." << std::endl;                                 \
+    TIME(sw, __VA_ARGS__);                                                     \
+    output.timings[ACTION] = sw.seconds();                                     \
+    std::cout << std::endl
 
 // Toggles
 bool view_mesh = true, 
@@ -81,31 +118,79 @@ float strands_start = 0.0f,
       node_vis_f = 0.5f;
 
 int main(int argc, char *argv[]) {
+    if (argc >= 2 && std::string(argv[1]) == "--convert") {
+        return convert_skeletons(argc, argv);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--batch") {
+        return run_batch(argc, argv);
+    }
     // Validating input
-    if (argc != 2) { // Error
-        std::cerr << "input an options file" << std::endl;
+    bool headless = false;
+    std::string options_file, cli_threads, cli_affinity;
+    bool valid_args = true;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--headless") {
+            headless = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            cli_threads = argv[++i];
+        } else if (arg == "--affinity" && i + 1 < argc) {
+            cli_affinity = argv[++i];
+        } else if (options_file.empty()) {
+            options_file = arg;
+        } else {
+            valid_args = false;
+        }
+    }
+    try {
+        if (!cli_threads.empty() && cli_threads != "auto") parse_thread_count(cli_threads);
+        if (!cli_affinity.empty()) parse_affinity(cli_affinity);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        valid_args = false;
+    }
+    if (!valid_args || options_file.empty()) { // Error
+        if (options_file.empty()) std::cerr << "input an options file" << std::endl;
+        std::cerr << "usage: tree_strands [--headless] [--threads N|auto] "
+                     "[--affinity none|close|spread] <options.json>" << std::endl;
+        std::cerr << "       tree_strands --batch [--jobs N] [--out DIR] [--threads N] "
+                     "[--affinity none|close|spread] <options.json|dir>..." << std::endl;
         return 1;
     }
 
-    // Seemed to be the fastest on Ryzen 5 5600
-    int num_threads = 10;
-    omp_set_num_threads(num_threads);
-
     //srand(time(NULL));
     srand(0);
 
     Stopwatch sw; // Performance stopwatch
- 
-#define STOPWATCH(ACTION, ...)                                                 \
-    std::cout << ACTION << "..." << std::endl;                                 \
-    TIME(sw, __VA_ARGS__);                                                     \
-    std::cout << std::endl
 
     // Parse options
-    std::filesystem::path file(argv[1]);
+    std::filesystem::path file(options_file);
     auto option_file = std::ifstream(file);
     json opt_data = json::parse(option_file);
     opt_data["path"]=file.remove_filename();
+    if (opt_data.contains("headless") && opt_data.at("headless")) {
+        headless = true;
+    }
+    // Command line thread settings win over the options file
+    if (!cli_threads.empty()) {
+        opt_data["threads"] = cli_threads == "auto" ? json("auto") : json(parse_thread_count(cli_threads));
+    }
+    if (!cli_affinity.empty()) {
+        opt_data["thread_affinity"] = cli_affinity;
+    }
+
+    // Set up output file
+    setup_output(opt_data, std::string(opt_data["path"])+"output/", output);
+
+    try {
+        configure_threads(opt_data, output);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (headless) {
+        return run_headless(opt_data, output);
+    }
 
     // Creating tree
     STOPWATCH("Parsing Skeleton", Skeleton tree(opt_data););
@@ -114,13 +199,10 @@ int main(int argc, char *argv[]) {
     STOPWATCH("Initializing Grid",
             Grid gr = Grid(tree, 0.01f, opt_data.at("grid_scale"));
             );
+    apply_fill_mode(gr, opt_data);
+
     // Make camera according to grid
-    cameras.push_back(Camera(gr.get_center(), 2.5f*(gr.get_center()-gr.get_backbottomleft()).z, width, height));
-    if (opt_data.contains("cameras")){
-        for (auto cam_data : opt_data.at("cameras")){
-            cameras.push_back(Camera(cam_data, width, height));
-        }
-    }
+    cameras = make_cameras(gr, opt_data);
     // Toggle interactive mode
     if (opt_data.contains("interactive_mode")) {
         interactive = opt_data.at("interactive_mode");
@@ -137,17 +219,6 @@ int main(int argc, char *argv[]) {
     Shader shader("resources/shaders/default.vert",
             "resources/shaders/default.frag");
 
-    // Set up output file
-    if (opt_data.contains("image_path")) {
-        image_prefix = opt_data["image_path"];
-    }
-    image_prefix=std::string(opt_data["path"])+"output/"+image_prefix;
-    if (!std::filesystem::is_directory(std::filesystem::path(image_prefix).remove_filename())){
-      std::string mkdir_cmd = std::string("mkdir -p ")+
-        std::string(std::filesystem::path(image_prefix).remove_filename());
-      system(mkdir_cmd.c_str());
-    }
-
     // Tree detail
     STOPWATCH("Adding Strands",
         Strands detail(tree, gr, opt_data);
@@ -175,7 +246,7 @@ int main(int argc, char *argv[]) {
 
     if (opt_data.contains("save_mesh") && opt_data.at("save_mesh") && !interactive){
         STOPWATCH("Exporting Data", 
-                    save_mesh(tree_geom);
+                    save_mesh(output, gr, surface_val);
                 );
     }
 
@@ -192,7 +263,7 @@ int main(int argc, char *argv[]) {
 
     system("notify-send \"Done Building Tree\"");
 
-    gr.calc_data();
+    gr.calc_data(surface_val);
     // Render loop
     while ((interactive && !glfwWindowShouldClose(window))||
             (!interactive && !done_screenshots)) {
@@ -269,7 +340,7 @@ int main(int argc, char *argv[]) {
         }
         if (export_mesh){
             STOPWATCH("Exporting Data", 
-            save_mesh(tree_geom);
+            save_mesh(output, gr, surface_val);
             export_mesh = false;
             );
         }
@@ -281,6 +352,268 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+// tree_strands --headless <options.json>, or "headless": true in the options
+// Grows every stage and writes the mesh and timings without opening a window,
+// so no GL context is made and meshes never leave the CPU. Screenshots from
+// the predefined cameras are drawn with the software rasterizer.
+int run_headless(json& opt_data, Output& output) {
+    Stopwatch sw;
+    STOPWATCH("Parsing Skeleton", Skeleton tree(opt_data););
+    STOPWATCH("Initializing Grid",
+            Grid gr = Grid(tree, 0.01f, opt_data.at("grid_scale"));
+            );
+    apply_fill_mode(gr, opt_data);
+    std::vector<Camera> views = make_cameras(gr, opt_data);
+
+    STOPWATCH("Adding Strands",
+        Strands detail(tree, gr, opt_data);
+        while (detail.add_stage() > 0) {}
+        );
+    float surface_val = opt_data.at("mesh_iso");
+    STOPWATCH("Exporting Data", save_mesh(output, gr, surface_val););
+    if (views.size() > 1) {
+        STOPWATCH("Rendering Screenshots",
+            render_screenshots(output, views, gr.get_occupied_geom(surface_val), detail.get_mesh());
+            );
+    }
+    gr.calc_data(surface_val);
+
+    std::string timings_file = output.prefix + "_timings.json";
+    std::ofstream out(timings_file);
+    out << output.timings.dump(4) << std::endl;
+    if (!out) {
+        std::cerr << "Could not write " << timings_file << std::endl;
+        return 1;
+    }
+    std::cout << "Saved timings: " << timings_file << std::endl;
+    return 0;
+}
+
+// tree_strands --batch [--jobs N] [--out DIR] [--threads N] [--affinity A]
+//                      <options.json|dir>...
+// Builds every tree headless in this one process, so the OpenMP threads are
+// made once and reused. A directory stands for the options files in it.
+// Each tree's files go in DIR/<options name>/, and DIR/summary.json records
+// how every run went. --jobs builds that many trees at once, splitting the
+// threads (every core by default) between them, which pays off when the
+// trees are small. Thread settings in the trees' options are not used.
+int run_batch(int argc, char *argv[]) {
+    namespace fs = std::filesystem;
+    const char* usage = "usage: tree_strands --batch [--jobs N] [--out DIR] [--threads N] "
+                        "[--affinity none|close|spread] <options.json|dir>...";
+    int jobs = 1, threads = 0;
+    Affinity affinity = Affinity::None;
+    fs::path out_dir = "batch_output";
+    std::vector<fs::path> files;
+    for (int i = 2; i < argc; i++) {
+        std::string arg(argv[i]);
+        if ((arg == "--jobs" || arg == "--out" || arg == "--threads" || arg == "--affinity")
+                && i + 1 >= argc) {
+            std::cerr << arg << " needs a value" << std::endl;
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+        try {
+            if (arg == "--jobs") {
+                jobs = std::max(1, parse_thread_count(argv[++i]));
+            } else if (arg == "--threads") {
+                threads = parse_thread_count(argv[++i]);
+            } else if (arg == "--affinity") {
+                affinity = parse_affinity(argv[++i]);
+            } else if (arg == "--out") {
+                out_dir = argv[++i];
+            } else if (fs::is_directory(arg)) {
+                std::vector<fs::path> in_dir;
+                for (const auto& entry : fs::directory_iterator(arg)) {
+                    if (entry.is_regular_file() && entry.path().extension() == ".json")
+                        in_dir.push_back(entry.path());
+                }
+                std::sort(in_dir.begin(), in_dir.end());
+                files.insert(files.end(), in_dir.begin(), in_dir.end());
+            } else {
+                files.push_back(arg);
+            }
+        } catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+    }
+    if (files.empty()) {
+        std::cerr << usage << std::endl;
+        return 1;
+    }
+    // Options files with the same name get numbered folders
+    std::vector<fs::path> tree_dirs;
+    std::map<std::string, int> name_count;
+    for (const auto& file : files) {
+        std::string name = file.stem().string();
+        int n = name_count[name]++;
+        tree_dirs.push_back(out_dir / (n == 0 ? name : name + "_" + std::to_string(n)));
+    }
+
+    jobs = std::min<int>(jobs, files.size());
+    if (threads <= 0) threads = hardware_threads();
+    int threads_per_job = std::max(1, threads / jobs);
+    std::vector<json> results(files.size());
+    std::atomic<size_t> next_file = 0;
+    auto worker = [&]() {
+        // The thread count is per thread, so each job keeps its own share.
+        // Jobs would pin their threads onto the same cores, so only a lone
+        // job is pinned.
+        set_threads(threads_per_job, jobs == 1 ? affinity : Affinity::None);
+        for (size_t i; (i = next_file.fetch_add(1)) < files.size();) {
+            json& result = results[i];
+            result["options"] = files[i].string();
+            result["output"] = tree_dirs[i].string();
+            auto start = std::chrono::steady_clock::now();
+            try {
+                auto option_file = std::ifstream(files[i]);
+                json opt_data = json::parse(option_file);
+                opt_data["path"] = fs::path(files[i]).remove_filename();
+                Output out;
+                setup_output(opt_data, tree_dirs[i], out);
+                result["status"] = run_headless(opt_data, out) == 0 ? "ok" : "failed";
+                result["timings"] = out.timings;
+            } catch (const std::exception& e) {
+                result["status"] = "failed";
+                result["error"] = e.what();
+            }
+            result["seconds"] = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
+    };
+    if (jobs == 1) {
+        worker();
+    } else {
+        std::vector<std::thread> pool;
+        for (int j = 0; j < jobs; j++) pool.emplace_back(worker);
+        for (auto& t : pool) t.join();
+    }
+
+    int failed = 0;
+    std::cout << "Batch of " << files.size() << " trees:" << std::endl;
+    for (const json& result : results) {
+        bool ok = result["status"] == "ok";
+        failed += !ok;
+        std::cout << (ok ? "  ok     " : "  FAILED ") << result["options"].get<std::string>()
+                  << " (" << result["seconds"].get<double>() << "s)";
+        if (result.contains("error")) std::cout << ": " << result["error"].get<std::string>();
+        std::cout << std::endl;
+    }
+    fs::create_directories(out_dir);
+    std::ofstream summary(out_dir / "summary.json");
+    summary << json{{"jobs", jobs}, {"threads_per_job", threads_per_job},
+                    {"affinity", to_string(jobs == 1 ? affinity : Affinity::None)},
+                    {"trees", results}}.dump(4) << std::endl;
+    std::cout << "Saved summary: " << (out_dir / "summary.json").string() << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
+// "threads" is a count or "auto", which times strands being grown and filled
+// on this tree at a few thread counts and keeps the fastest.
+// "thread_affinity" is none, close or spread. Unset, OpenMP's defaults stay
+// (OMP_NUM_THREADS or every core, unpinned).
+void configure_threads(json& opt_data, Output& output) {
+    Affinity affinity = parse_affinity(opt_data.value("thread_affinity", "none"));
+    int threads = 0;
+    if (opt_data.contains("threads")) {
+        if (opt_data.at("threads") == "auto") {
+            threads = tune_threads(opt_data, output, affinity);
+        } else {
+            threads = opt_data.at("threads");
+        }
+    }
+    set_threads(threads, affinity);
+    std::cout << "Threads: " << omp_get_max_threads()
+              << " (affinity: " << to_string(affinity) << ")" << std::endl;
+}
+
+// Grows "tune_strands" strands (32 by default) on a fresh grid at 1, 2, 4...
+// threads and every core. Growing (find_target/find_extension) and filling
+// (fill_path) are timed apart and written to <prefix>_threads.json.
+int tune_threads(json& opt_data, Output& output, Affinity affinity) {
+    Stopwatch sw;
+    int sample = opt_data.value("tune_strands", 32);
+    std::vector<int> counts;
+    for (int t = 1; t < hardware_threads(); t *= 2) counts.push_back(t);
+    counts.push_back(hardware_threads());
+
+    json trials = json::array();
+    int best = counts.back();
+    double best_seconds = std::numeric_limits<double>::max();
+    STOPWATCH("Tuning Threads",
+        Skeleton tree(opt_data);
+        for (int threads : counts) {
+            set_threads(threads, affinity);
+            Grid gr(tree, 0.01f, opt_data.at("grid_scale"));
+            apply_fill_mode(gr, opt_data);
+            Strands detail(tree, gr, opt_data);
+            detail.add_strands(sample);
+            const Strands::Profile& profile = detail.get_profile();
+            trials.push_back({{"threads", threads}, {"grow", profile.grow},
+                              {"fill", profile.fill}});
+            if (profile.grow + profile.fill < best_seconds) {
+                best_seconds = profile.grow + profile.fill;
+                best = threads;
+            }
+        }
+        );
+    std::cout << "threads  grow (s)  fill (s)" << std::endl << std::fixed;
+    for (const json& trial : trials) {
+        std::cout << std::setw(7) << trial["threads"].get<int>()
+                  << std::setw(10) << std::setprecision(3) << trial["grow"].get<double>()
+                  << std::setw(10) << trial["fill"].get<double>() << std::endl;
+    }
+    std::cout << std::defaultfloat;
+    std::cout << "Fastest with " << best << " threads" << std::endl;
+
+    std::string threads_file = output.prefix + "_threads.json";
+    std::ofstream out(threads_file);
+    out << json{{"best", best}, {"strands", sample},
+                {"affinity", to_string(affinity)}, {"trials", trials}}.dump(4) << std::endl;
+    return best;
+}
+
+void apply_fill_mode(Grid& gr, const json& opt_data) {
+    if (opt_data.contains("fill_mode") && opt_data.at("fill_mode") == "staged") {
+        gr.set_fill_mode(Grid::Staged);
+    }
+}
+
+// tree_strands --convert [--no-frames] <skeleton.txt>...
+// Writes each text skeleton next to itself as a binary .skel file
+int convert_skeletons(int argc, char *argv[]) {
+    bool with_frames = true;
+    int converted = 0;
+    for (int i = 2; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--no-frames") {
+            with_frames = false;
+            continue;
+        }
+        std::filesystem::path out_file(arg);
+        out_file.replace_extension(".skel");
+        try {
+            Skeleton::Nodes nodes = Skeleton::load(arg);
+            Skeleton::save_binary(nodes, out_file, with_frames);
+            std::cout << arg << " -> " << out_file.string() << " ("
+                      << nodes.size() << " nodes, "
+                      << std::filesystem::file_size(out_file) / 1024 << " KB)"
+                      << std::endl;
+            converted++;
+        } catch (const std::exception &e) {
+            std::cerr << "Could not convert " << arg << ": " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (converted == 0) {
+        std::cerr << "usage: tree_strands --convert [--no-frames] <skeleton.txt>..." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
 GLFWwindow *openGLInit() {
     // GLFW init
     if (!glfwInit()) {
@@ -338,76 +671,71 @@ void framebuffer_size_callback(GLFWwindow *window, int w, int h) {
     }
 }
 
-int images_taken = 0;
+void save_pixels(Output& out, std::span<const uint8_t> rgb){
+    std::string file_name = out.prefix + "_" + std::to_string(out.images_taken) + ".png";
+    write_png(file_name, width, height, rgb);
+    std::cout<<"Saved image: "<<file_name<<std::endl;
+    out.images_taken++;
+}
+
 void save_image(){
-    std::string file_name = image_prefix + "_" + std::to_string(images_taken) + ".png";
-    // Make temporary ppm file
-    std::string temp_file = "/tmp/tree_image.ppm";
-    std::ofstream out(temp_file);
-    out<<"P3\n# "<<temp_file<<"\n"<<width<<" "<<height<<"\n255"<<std::endl;
-    GLubyte* pixels = new GLubyte[3 * width * height];
-    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
-    for (int i = height - 1; i >= 0; i--) {
-        for (int j = 0; j < width; j++) {
-            int ptr = (i * width + j) * 3;
-            out << (int)pixels[ptr] << " " 
-                << (int)pixels[ptr + 1] << " " 
-                << (int)pixels[ptr + 2] << " ";
+    std::vector<GLubyte> pixels(3 * width * height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    // GL rows go bottom to top
+    std::vector<uint8_t> flipped(pixels.size());
+    for (int i = 0; i < height; i++) {
+        std::copy_n(pixels.begin() + (height - 1 - i) * width * 3, width * 3,
+                    flipped.begin() + i * width * 3);
+    }
+    save_pixels(output, flipped);
+}
+
+// Same shots as the non-interactive render loop: every predefined camera
+// takes one with the tree mesh and strands, then one with just the strands
+void render_screenshots(Output& out, const std::vector<Camera>& views,
+        const Mesh<Vertex>& tree_geom, const Mesh<Vertex>& strands_geom){
+    Rasterizer raster(width, height);
+    for (size_t cam = 1; cam < views.size(); cam++) {
+        for (bool with_mesh : {true, false}) {
+            raster.clear(SKY_COLOR);
+            if (with_mesh && view_mesh)
+                raster.draw(tree_geom, views[cam], GL_TRIANGLES, Rasterizer::Lit);
+            if (view_strands)
+                raster.draw(strands_geom, views[cam], GL_LINES);
+            save_pixels(out, raster.get_pixels());
         }
     }
-    out.close();
-    delete [] pixels;
-    // Make PNG
-    std::string convert_cmd =  "magick " + temp_file + " " + file_name;
-    system(convert_cmd.c_str());
-    std::cout<<"Saved image: "<<file_name<<std::endl;
-    images_taken++;
 }
 
-int meshes_exported = 0;
-void save_mesh(Mesh<Vertex> mesh){
-    std::string file_name = image_prefix +"_"+ std::to_string(meshes_exported) + ".ply";
-    std::ofstream out(file_name);
+void save_mesh(Output& out, Grid& grid, float threshold){
+    std::string file_name = out.prefix +"_"+ std::to_string(out.meshes_exported) + ".ply";
     glm::mat4 pos_transform = glm::scale(glm::vec3(2,2,2));
-    glm::mat3 norm_scale = glm::scale(glm::vec3(100,100,100));
-    out<<"ply\n";
-    out<<"format ascii 1.0\n";
-    out<<"element vertex "<<mesh.vertices.size()<<"\n";
-    out<<"property float x\n";
-    out<<"property float y\n";
-    out<<"property float z\n";
-    out<<"property float nx\n";
-    out<<"property float ny\n";
-    out<<"property float nz\n";
-    out<<"property uchar red\n";
-    out<<"property uchar green\n";
-    out<<"property uchar blue\n";
-    out<<"element face "<<mesh.indices.size()/3<<"\n";
-    out<<"property list uchar int vertex_index\n";
-    out<<"end_header\n";
-    out<<std::fixed;
-    out<<std::setprecision(10);
-    for (Vertex vertex : mesh.vertices){
-        glm::vec3 pos = pos_transform*glm::vec4(vertex.position,1.f);
-        glm::vec3 normal = vertex.normal;
-        glm::vec3 col = vertex.color;
-        if (glm::any(glm::isnan(normal))){
-            //std::cout <<"IS NAN"<<std::endl;
-            normal = glm::vec3();
-        }
-        out <<pos.x<<" "<<pos.y<<" "<<pos.z<<" "
-            <<normal.x<<" "<<normal.y<<" "<<normal.z<<" "
-            <<(int)(col.r*255)<<" "<<(int)(col.g*255)<<" "<<(int)(col.b*255)<<"\n";
+    grid.save_occupied_geom(threshold, file_name, pos_transform);
+    std::cout<<"Exported Mesh: "<<file_name<<std::endl;
+    out.meshes_exported++;
+}
+
+// Files are named dir/<image_path>_<n>
+void setup_output(const json& opt_data, const std::filesystem::path& dir, Output& out){
+    std::string image_path = "tree";
+    if (opt_data.contains("image_path")) {
+        image_path = opt_data["image_path"];
     }
-    for (int i=0; i<=mesh.indices.size()-3; i+=3){
-        GLuint v0 = mesh.indices[i];
-        GLuint v1 = mesh.indices[i+1];
-        GLuint v2 = mesh.indices[i+2];
-        out<<"3 "<<v0<<" "<<v1<<" "<<v2<<"\n";
+    out.prefix = (dir / image_path).string();
+    std::filesystem::create_directories(std::filesystem::path(out.prefix).parent_path());
+}
+
+// The first camera frames the whole grid, the rest come from the options
+std::vector<Camera> make_cameras(Grid& gr, const json& opt_data){
+    std::vector<Camera> views;
+    views.push_back(Camera(gr.get_center(), 2.5f*(gr.get_center()-gr.get_backbottomleft()).z, width, height));
+    if (opt_data.contains("cameras")){
+        for (auto cam_data : opt_data.at("cameras")){
+            views.push_back(Camera(cam_data, width, height));
+        }
     }
-    out.close();
-    std::cout<<"Exported Mesh: "<<file_name<<std::endl;
-    meshes_exported++;
+    return views;
 }
 
 #define PANSENS 0.38f
@@ -1,4 +1,5 @@
 #pragma once
+#include <optional>
 #include <vector>
 
 #include <glad/glad.h>
@@ -18,37 +19,39 @@ template <typename T> class Mesh
         std::vector<T> vertices;
         std::vector<GLuint> indices;
 
+        // Meshes stay on the CPU until first drawn, so they can be made
+        // without a GL context
         Mesh(std::vector<T> vertices, std::vector<GLuint> indices):
             vertices(vertices),
             indices(indices)
-        {
-            this->update();
-        }
+        {}
 
         // TODO: see if necessary
         void update(){
-            vao.bind();
+            if (!vao) vao.emplace();
+            vao->bind();
 
             VBO<T> vbo(vertices);
             EBO ebo(indices);
 
-            vao.link_attribs(vbo);
+            vao->link_attribs(vbo);
 
-            vao.unbind();
+            vao->unbind();
             vbo.unbind();
             ebo.unbind();
         }
 
         void draw(Shader& shader, const Camera& camera, GLenum mode)
         {
+            if (!vao) update();
             shader.use();
 
             shader.setUniform("cam", camera.get_matrix());
             shader.setUniform("camPos", camera.get_position());
 
-            vao.bind();
+            vao->bind();
             glDrawElements(mode, indices.size(), GL_UNSIGNED_INT, 0);
         }
     private:
-        VAO<T> vao;
+        std::optional<VAO<T>> vao;
 };
@@ -0,0 +1,266 @@
+#include "rendering/rasterizer.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+namespace {
+struct Light{
+  glm::vec3 dir;
+  float diff_strength;
+  float spec_strength;
+  int specular_pow;
+};
+// Same lights as resources/shaders/default.frag
+const std::array<Light, 7> lights = {
+  Light{glm::normalize(glm::vec3(0,1.0,0.2)),0.8,0.2,2},
+  Light{glm::normalize(glm::vec3(0,-1.0,0.0)),0.6,0.0,2},
+  Light{glm::normalize(glm::vec3(0,1.0,-0.2)),0.7,0.1,2},
+  Light{glm::normalize(glm::vec3(1.0,0,0)),0.5,0.1,2},
+  Light{glm::normalize(glm::vec3(-1.0,0,0)),0.4,0.1,2},
+  Light{glm::normalize(glm::vec3(0.0,0,1.0)),0.2,0.1,2},
+  Light{glm::normalize(glm::vec3(0.0,0,-1.0)),0.2,0.1,2},
+};
+
+float near_dist(const glm::vec4& clip){ return clip.z+clip.w; }
+
+// Liang-Barsky: narrows [t0, t1] to the part of a+d*t inside [0,size].
+// False if none of it is
+bool clip_to_rect(glm::vec2 a, glm::vec2 d, glm::vec2 size, float& t0, float& t1){
+  // Each edge is p*t <= q
+  const float p[4] = {-d.x, d.x, -d.y, d.y};
+  const float q[4] = {a.x, size.x-a.x, a.y, size.y-a.y};
+  for (int e=0; e<4; e++){
+    if (p[e] == 0.f){
+      if (q[e] < 0.f) return false;
+      continue;
+    }
+    float r = q[e]/p[e];
+    if (p[e] < 0.f) t0 = std::max(t0, r);
+    else t1 = std::min(t1, r);
+  }
+  return t0 <= t1;
+}
+}
+
+Rasterizer::Rasterizer(int width, int height)
+  : width(width), height(height), color((size_t)width*height), depth((size_t)width*height, 1.f) {}
+
+void Rasterizer::clear(glm::vec4 clear_color){
+  std::fill(color.begin(), color.end(), glm::vec3(clear_color));
+  std::fill(depth.begin(), depth.end(), 1.f);
+}
+
+std::vector<uint8_t> Rasterizer::get_pixels() const {
+  std::vector<uint8_t> pixels(color.size()*3);
+  for (size_t i=0; i<color.size(); i++){
+    for (int c=0; c<3; c++)
+      pixels[i*3+c] = std::lround(std::clamp(color[i][c], 0.f, 1.f)*255.f);
+  }
+  return pixels;
+}
+
+Rasterizer::ScreenVertex Rasterizer::project(const ClipVertex& v) const {
+  ScreenVertex s;
+  s.inv_w = 1.f/v.clip.w;
+  glm::vec3 ndc = glm::vec3(v.clip)*s.inv_w;
+  // Row 0 is the top of the image
+  s.xy = glm::vec2((ndc.x*0.5f+0.5f)*width, (0.5f-ndc.y*0.5f)*height);
+  s.depth = ndc.z*0.5f+0.5f;
+  s.pos = v.pos*s.inv_w;
+  s.color = v.color*s.inv_w;
+  s.normal = v.normal*s.inv_w;
+  return s;
+}
+
+void Rasterizer::fragment(int x, int y, float z, const glm::vec3& pos, const glm::vec3& col,
+    const glm::vec3& normal, glm::vec3 cam_pos, Shading shading){
+  if (x<0 || y<0 || x>=width || y>=height || z<0.f || z>1.f) return;
+  size_t idx = (size_t)y*width+x;
+  if (!(z < depth[idx])) return;
+  depth[idx] = z;
+  if (shading == Flat){
+    color[idx] = col;
+    return;
+  }
+  float ambient = 1.f, diffuse = 0.f, specular = 0.f;
+  glm::vec3 n = glm::normalize(normal);
+  // Zero normals come out NaN in GL, here they just get no direct light
+  if (!glm::any(glm::isnan(n))){
+    glm::vec3 view_dir = glm::normalize(cam_pos-pos);
+    for (const Light& light : lights){
+      diffuse += light.diff_strength*std::max(glm::dot(n, light.dir), 0.f);
+      glm::vec3 reflect_dir = glm::reflect(-light.dir, n);
+      specular += light.spec_strength*std::pow(std::max(glm::dot(view_dir, reflect_dir), 0.f),
+          (float)light.specular_pow);
+    }
+  }
+  color[idx] = col*(diffuse+ambient+specular);
+}
+
+void Rasterizer::draw_triangles(std::span<const ClipVertex> verts, std::span<const GLuint> indices,
+    glm::vec3 cam_pos, Shading shading){
+  // Clip against the near plane, the rest is left to the viewport and
+  // depth range checks
+  std::vector<ScreenVertex> screen(verts.size());
+  #pragma omp parallel for
+  for (size_t i=0; i<verts.size(); i++){
+    if (near_dist(verts[i].clip) >= 0.f) screen[i] = project(verts[i]);
+  }
+  std::vector<std::array<uint32_t,3>> tris;
+  tris.reserve(indices.size()/3);
+  for (size_t i=0; i+2<indices.size(); i+=3){
+    std::array<GLuint,3> tri = {indices[i], indices[i+1], indices[i+2]};
+    int inside = 0;
+    for (GLuint v : tri) inside += near_dist(verts[v].clip) >= 0.f;
+    if (inside == 3){
+      tris.push_back(tri);
+      continue;
+    }
+    if (inside == 0) continue;
+    // One or two corners behind the near plane, the rest becomes a fan
+    std::vector<uint32_t> polygon;
+    for (int c=0; c<3; c++){
+      const ClipVertex& a = verts[tri[c]];
+      const ClipVertex& b = verts[tri[(c+1)%3]];
+      float da = near_dist(a.clip), db = near_dist(b.clip);
+      if (da >= 0.f) polygon.push_back(tri[c]);
+      if ((da >= 0.f) != (db >= 0.f)){
+        float t = da/(da-db);
+        ClipVertex cut{glm::mix(a.clip, b.clip, t), glm::mix(a.pos, b.pos, t),
+          glm::mix(a.color, b.color, t), glm::mix(a.normal, b.normal, t)};
+        polygon.push_back(screen.size());
+        screen.push_back(project(cut));
+      }
+    }
+    for (size_t c=1; c+1<polygon.size(); c++)
+      tris.push_back({polygon[0], polygon[c], polygon[c+1]});
+  }
+  auto edge = [](glm::vec2 p, glm::vec2 q, glm::vec2 r){
+    return (q.x-p.x)*(r.y-p.y)-(q.y-p.y)*(r.x-p.x);
+  };
+  // Pixels each triangle covers on screen, empty if it covers none
+  struct Bounds{ int x0, x1, y0, y1; };
+  std::vector<Bounds> bounds(tris.size());
+  #pragma omp parallel for
+  for (size_t t=0; t<tris.size(); t++){
+    const ScreenVertex& a = screen[tris[t][0]];
+    const ScreenVertex& b = screen[tris[t][1]];
+    const ScreenVertex& c = screen[tris[t][2]];
+    bounds[t] = {0, -1, 0, -1};
+    // Also rules out corners that aren't finite
+    float area = edge(a.xy, b.xy, c.xy);
+    if (area == 0.f || !std::isfinite(area)) continue;
+    // Clamped first so the conversions to int can't overflow
+    auto lo = [](float v, int size){ return std::max(0, (int)std::ceil(std::clamp(v-0.5f, -1.f, (float)size))); };
+    auto hi = [](float v, int size){ return std::min(size-1, (int)std::floor(std::clamp(v-0.5f, -1.f, (float)size))); };
+    bounds[t] = {
+      lo(std::min({a.xy.x, b.xy.x, c.xy.x}), width), hi(std::max({a.xy.x, b.xy.x, c.xy.x}), width),
+      lo(std::min({a.xy.y, b.xy.y, c.xy.y}), height), hi(std::max({a.xy.y, b.xy.y, c.xy.y}), height),
+    };
+  }
+  // Bin the triangles by the bands they touch, in submission order
+  int num_bands = (height+band_rows-1)/band_rows;
+  std::vector<uint32_t> bin_start(num_bands+1, 0);
+  auto covers = [&](const Bounds& b){ return b.x0 <= b.x1 && b.y0 <= b.y1; };
+  for (const Bounds& b : bounds){
+    if (!covers(b)) continue;
+    for (int band=b.y0/band_rows; band<=b.y1/band_rows; band++) bin_start[band+1]++;
+  }
+  for (int band=0; band<num_bands; band++) bin_start[band+1] += bin_start[band];
+  std::vector<uint32_t> bins(bin_start.back());
+  {
+    std::vector<uint32_t> fill(bin_start.begin(), bin_start.end()-1);
+    for (size_t t=0; t<bounds.size(); t++){
+      if (!covers(bounds[t])) continue;
+      for (int band=bounds[t].y0/band_rows; band<=bounds[t].y1/band_rows; band++) bins[fill[band]++] = t;
+    }
+  }
+  // Threads own horizontal bands of the image, so fragments never race and
+  // triangles land in submission order within each pixel
+  #pragma omp parallel for schedule(dynamic)
+  for (int band=0; band<num_bands; band++){
+    int band_y0 = band*band_rows;
+    int band_y1 = std::min(height, band_y0+band_rows);
+    for (uint32_t k=bin_start[band]; k<bin_start[band+1]; k++){
+      const auto& tri = tris[bins[k]];
+      const Bounds& bound = bounds[bins[k]];
+      const ScreenVertex& a = screen[tri[0]];
+      const ScreenVertex& b = screen[tri[1]];
+      const ScreenVertex& c = screen[tri[2]];
+      int y0 = std::max(band_y0, bound.y0);
+      int y1 = std::min(band_y1-1, bound.y1);
+      int x0 = bound.x0, x1 = bound.x1;
+      float area = edge(a.xy, b.xy, c.xy);
+      for (int y=y0; y<=y1; y++){
+        for (int x=x0; x<=x1; x++){
+          glm::vec2 p(x+0.5f, y+0.5f);
+          float la = edge(b.xy, c.xy, p)/area;
+          float lb = edge(c.xy, a.xy, p)/area;
+          float lc = edge(a.xy, b.xy, p)/area;
+          if (la < 0.f || lb < 0.f || lc < 0.f) continue;
+          float z = la*a.depth+lb*b.depth+lc*c.depth;
+          float w = 1.f/(la*a.inv_w+lb*b.inv_w+lc*c.inv_w);
+          fragment(x, y, z,
+              (la*a.pos+lb*b.pos+lc*c.pos)*w,
+              (la*a.color+lb*b.color+lc*c.color)*w,
+              (la*a.normal+lb*b.normal+lc*c.normal)*w,
+              cam_pos, shading);
+        }
+      }
+    }
+  }
+}
+
+void Rasterizer::draw_lines(std::span<const ClipVertex> verts, std::span<const GLuint> indices,
+    glm::vec3 cam_pos, Shading shading){
+  for (size_t i=0; i+1<indices.size(); i+=2){
+    ClipVertex a = verts[indices[i]], b = verts[indices[i+1]];
+    float da = near_dist(a.clip), db = near_dist(b.clip);
+    if (da < 0.f && db < 0.f) continue;
+    if (da < 0.f || db < 0.f){
+      float t = da/(da-db);
+      ClipVertex cut{glm::mix(a.clip, b.clip, t), glm::mix(a.pos, b.pos, t),
+        glm::mix(a.color, b.color, t), glm::mix(a.normal, b.normal, t)};
+      (da < 0.f ? a : b) = cut;
+    }
+    ScreenVertex sa = project(a), sb = project(b);
+    if (!std::isfinite(sa.xy.x+sa.xy.y+sb.xy.x+sb.xy.y)) continue;
+    // Only step over the part inside the image. Everything in a
+    // ScreenVertex is linear on screen, so the ends can just be mixed
+    float t0 = 0.f, t1 = 1.f;
+    if (!clip_to_rect(sa.xy, sb.xy-sa.xy, glm::vec2(width, height), t0, t1)) continue;
+    auto mix = [](const ScreenVertex& p, const ScreenVertex& q, float t){
+      return ScreenVertex{glm::mix(p.xy, q.xy, t), glm::mix(p.depth, q.depth, t),
+        glm::mix(p.inv_w, q.inv_w, t), glm::mix(p.pos, q.pos, t),
+        glm::mix(p.color, q.color, t), glm::mix(p.normal, q.normal, t)};
+    };
+    if (t1 < 1.f) sb = mix(sa, sb, t1);
+    if (t0 > 0.f) sa = mix(sa, sb, t0/t1);
+    glm::vec2 d = sb.xy-sa.xy;
+    int steps = std::max(1, (int)std::ceil(std::max(std::abs(d.x), std::abs(d.y))));
+    for (int s=0; s<=steps; s++){
+      float t = (float)s/steps;
+      glm::vec2 p = sa.xy+d*t;
+      float w = 1.f/glm::mix(sa.inv_w, sb.inv_w, t);
+      fragment((int)std::floor(p.x), (int)std::floor(p.y), glm::mix(sa.depth, sb.depth, t),
+          glm::mix(sa.pos, sb.pos, t)*w, glm::mix(sa.color, sb.color, t)*w,
+          glm::mix(sa.normal, sb.normal, t)*w, cam_pos, shading);
+    }
+  }
+}
+
+void Rasterizer::draw_points(std::span<const ClipVertex> verts, std::span<const GLuint> indices,
+    glm::vec3 cam_pos, Shading shading){
+  for (GLuint i : indices){
+    if (near_dist(verts[i].clip) < 0.f) continue;
+    ScreenVertex s = project(verts[i]);
+    int x0 = (int)std::floor(s.xy.x-point_size*0.5f+0.5f);
+    int y0 = (int)std::floor(s.xy.y-point_size*0.5f+0.5f);
+    for (int y=y0; y<y0+point_size; y++){
+      for (int x=x0; x<x0+point_size; x++){
+        fragment(x, y, s.depth, verts[i].pos, verts[i].color, verts[i].normal, cam_pos, shading);
+      }
+    }
+  }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "rendering/camera.h"
+#include "rendering/mesh.h"
+#include "rendering/VBO.h"
+
+// Draws meshes on the CPU the way the flat and default shaders do, so
+// screenshots can be taken without a window or GL context. Follows GL where
+// it matters for the output: near plane clipping, perspective correct
+// attributes, pixel centers at +0.5 and a less than depth test.
+class Rasterizer {
+public:
+  enum Shading{
+    Flat, // flat.frag: vertex color
+    Lit,  // default.frag: vertex color under its directional lights
+  };
+  Rasterizer(int width, int height);
+  void clear(glm::vec4 color);
+  // mode is GL_TRIANGLES, GL_LINES or GL_POINTS
+  template <typename T>
+  void draw(const Mesh<T>& mesh, const Camera& camera, GLenum mode, Shading shading = Flat);
+  // 8 bit RGB, rows top to bottom
+  std::vector<uint8_t> get_pixels() const;
+  int get_width() const { return width; }
+  int get_height() const { return height; }
+private:
+  struct ClipVertex{
+    glm::vec4 clip;
+    glm::vec3 pos;
+    glm::vec3 color;
+    glm::vec3 normal;
+  };
+  // After the perspective divide, attributes are pre-divided by w
+  struct ScreenVertex{
+    glm::vec2 xy;
+    float depth;
+    float inv_w;
+    glm::vec3 pos, color, normal; // over w
+  };
+  int width, height;
+  std::vector<glm::vec3> color;
+  std::vector<float> depth;
+  static constexpr int band_rows = 16;
+  static constexpr int point_size = 8;
+
+  void draw_triangles(std::span<const ClipVertex> verts, std::span<const GLuint> indices,
+      glm::vec3 cam_pos, Shading shading);
+  void draw_lines(std::span<const ClipVertex> verts, std::span<const GLuint> indices,
+      glm::vec3 cam_pos, Shading shading);
+  void draw_points(std::span<const ClipVertex> verts, std::span<const GLuint> indices,
+      glm::vec3 cam_pos, Shading shading);
+  ScreenVertex project(const ClipVertex& v) const;
+  // Writes the fragment if it passes the depth test
+  void fragment(int x, int y, float z, const glm::vec3& pos, const glm::vec3& col,
+      const glm::vec3& normal, glm::vec3 cam_pos, Shading shading);
+};
+
+template <typename T>
+void Rasterizer::draw(const Mesh<T>& mesh, const Camera& camera, GLenum mode, Shading shading){
+  glm::mat4 cam = camera.get_matrix();
+  std::vector<ClipVertex> verts(mesh.vertices.size());
+  #pragma omp parallel for
+  for (size_t i=0; i<verts.size(); i++){
+    const T& v = mesh.vertices[i];
+    verts[i].clip = cam*glm::vec4(v.position, 1.f);
+    verts[i].pos = v.position;
+    verts[i].color = v.color;
+    if constexpr (requires { v.normal; }) verts[i].normal = v.normal;
+    else verts[i].normal = glm::vec3(0);
+  }
+  switch (mode){
+    case GL_TRIANGLES: draw_triangles(verts, mesh.indices, camera.get_position(), shading); break;
+    case GL_LINES: draw_lines(verts, mesh.indices, camera.get_position(), shading); break;
+    case GL_POINTS: draw_points(verts, mesh.indices, camera.get_position(), shading); break;
+  }
+}
@@ -0,0 +1,95 @@
+#include "tree/angle_index.h"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+
+void AngleIndex::Counts::reset(size_t n) {
+  // Every count set, node i then covers lowbit(i) of them
+  tree.resize(n + 1);
+  for (size_t i = 1; i <= n; i++) tree[i] = i & (~i + 1);
+  total = n;
+}
+
+void AngleIndex::Counts::add(size_t i, int32_t v) {
+  for (i++; i < tree.size(); i += i & (~i + 1)) tree[i] += v;
+  total += v;
+}
+
+size_t AngleIndex::Counts::prefix(size_t i) const {
+  size_t sum = 0;
+  for (; i > 0; i -= i & (~i + 1)) sum += tree[i];
+  return sum;
+}
+
+size_t AngleIndex::Counts::find(size_t k) const {
+  assert(k < total);
+  size_t pos = 0;
+  for (size_t step = std::bit_floor(tree.size() - 1); step > 0; step >>= 1) {
+    if (pos + step < tree.size() && (size_t)tree[pos + step] <= k) {
+      pos += step;
+      k -= tree[pos];
+    }
+  }
+  return pos;
+}
+
+AngleIndex::AngleIndex(std::span<const glm::vec3> d) : dirs(d.begin(), d.end()) {
+  for (size_t id = 0; id < dirs.size(); id++)
+    if (!glm::any(glm::isnan(dirs[id]))) order.push_back(id);
+  auto azimuth = [&](size_t id){ return std::atan2(dirs[id].z, dirs[id].x); };
+  std::stable_sort(order.begin(), order.end(),
+      [&](size_t a, size_t b){ return azimuth(a) < azimuth(b); });
+  rank = std::vector<int64_t>(dirs.size(), -1);
+  for (size_t i = 0; i < order.size(); i++) {
+    azimuths.push_back(azimuth(order[i]));
+    rank[order[i]] = i;
+  }
+  reset();
+}
+
+void AngleIndex::reset() {
+  by_id.reset(dirs.size());
+  by_angle.reset(order.size());
+}
+
+void AngleIndex::remove(size_t id) {
+  assert(contains(id));
+  by_id.add(id, -1);
+  if (rank[id] >= 0) by_angle.add(rank[id], -1);
+}
+
+std::vector<size_t> AngleIndex::closest(glm::vec3 dir) const {
+  size_t left = by_angle.total;
+  if (left == 0 || glm::any(glm::isnan(dir))) return {};
+  // The nearest ids on either side of dir's azimuth are the best guesses.
+  // Dot products carry rounding error, so walk on past them while they come
+  // within eps of the best and take the exact maximum of all those seen
+  constexpr float eps = 1e-5f;
+  size_t pos = std::upper_bound(azimuths.begin(), azimuths.end(),
+      std::atan2(dir.z, dir.x)) - azimuths.begin();
+  size_t after = by_angle.prefix(pos) % left;
+  size_t before = (after + left - 1) % left;
+  std::vector<std::pair<size_t, float>> seen;
+  float best = -INFINITY;
+  auto visit = [&](size_t k) {
+    size_t id = order[by_angle.find(k)];
+    float cos = glm::dot(dir, dirs[id]);
+    seen.push_back({id, cos});
+    best = std::max(best, cos);
+    return cos;
+  };
+  visit(after);
+  size_t walked = 1;
+  for (size_t k = before; walked < left && visit(k) >= best - eps; k = (k + left - 1) % left)
+    walked++;
+  for (size_t k = (after + 1) % left; walked < left && visit(k) >= best - eps; k = (k + 1) % left)
+    walked++;
+  std::vector<size_t> matches;
+  for (auto [id, cos] : seen)
+    if (cos == best) matches.push_back(id);
+  std::sort(matches.begin(), matches.end());
+  matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+  return matches;
+}
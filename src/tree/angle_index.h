@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Set of ids for unit directions in the xz plane, sorted by azimuth. Finding
+// the direction closest to a query, removing an id and picking the k-th id
+// left all take O(log n), where a plain list would be scanned or shifted.
+class AngleIndex {
+public:
+  AngleIndex() = default;
+  explicit AngleIndex(std::span<const glm::vec3> dirs);
+  // Puts every id back
+  void reset();
+  void remove(size_t id);
+  bool contains(size_t id) const { return by_id.prefix(id + 1) - by_id.prefix(id) == 1; }
+  // Ids left
+  size_t size() const { return by_id.total; }
+  // The k-th id left, in increasing order
+  size_t nth(size_t k) const { return by_id.find(k); }
+  // Ids left whose dot product with dir is the largest, in increasing
+  // order. Empty if dir or every direction left is not a number
+  std::vector<size_t> closest(glm::vec3 dir) const;
+private:
+  // Fenwick tree of 0/1 counts
+  struct Counts {
+    std::vector<int32_t> tree;
+    size_t total = 0;
+    void reset(size_t n);
+    void add(size_t i, int32_t v);
+    // Number set before i
+    size_t prefix(size_t i) const;
+    // Position of the k-th one set
+    size_t find(size_t k) const;
+  };
+  std::vector<glm::vec3> dirs;
+  // Ids with a valid direction by azimuth, and each one's place in it
+  std::vector<size_t> order;
+  std::vector<float> azimuths;
+  std::vector<int64_t> rank;
+  Counts by_id;
+  Counts by_angle;
+};
@@ -0,0 +1,56 @@
+#include "tree/chunk_pool.h"
+#include <bit>
+#include <cassert>
+#include <climits>
+#include <utility>
+
+ChunkPool::ChunkPool(int32_t chunk_vol, int32_t max_chunks, int32_t chunks_per_segment)
+  : chunk_vol(chunk_vol), chunks_per_segment(chunks_per_segment) {
+  assert(std::has_single_bit((uint32_t)chunk_vol));
+  assert(std::has_single_bit((uint32_t)chunks_per_segment));
+  assert((int64_t)max_chunks*chunk_vol <= INT32_MAX);
+  segment_sz = chunk_vol*chunks_per_segment;
+  segment_shift = std::countr_zero((uint32_t)segment_sz);
+  segment_mask = segment_sz-1;
+  // Directory is sized for the worst case up front so it never reallocates
+  segments = std::vector<std::atomic<float*>>(
+      (max_chunks+chunks_per_segment-1)/chunks_per_segment);
+}
+
+ChunkPool& ChunkPool::operator=(ChunkPool&& other) noexcept {
+  if (this == &other) return *this;
+  for (auto& segment : segments) delete[] segment.load();
+  segments = std::move(other.segments);
+  chunk_vol = other.chunk_vol;
+  chunks_per_segment = other.chunks_per_segment;
+  segment_sz = other.segment_sz;
+  segment_shift = other.segment_shift;
+  segment_mask = other.segment_mask;
+  next_chunk = other.next_chunk.load();
+  segments_committed = other.segments_committed.load();
+  other.next_chunk = 0;
+  other.segments_committed = 0;
+  return *this;
+}
+
+ChunkPool::~ChunkPool(){
+  for (auto& segment : segments) delete[] segment.load();
+}
+
+int32_t ChunkPool::allocate(){
+  int32_t chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+  int32_t segment = chunk/chunks_per_segment;
+  assert(segment<segments.size());
+  if (!segments[segment].load(std::memory_order_acquire)){
+    // Several threads may race to commit the same segment, only one wins
+    float* fresh = new float[segment_sz](); // zeroed
+    float* expected = nullptr;
+    if (segments[segment].compare_exchange_strong(expected, fresh,
+          std::memory_order_acq_rel)){
+      segments_committed.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      delete[] fresh;
+    }
+  }
+  return chunk*chunk_vol;
+}
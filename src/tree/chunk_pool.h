@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Segmented arena of fixed size voxel chunks. Segments are allocated on demand
+// and never move, so a flat index handed out by allocate() stays valid while
+// other chunks are being added. allocate() is lock-free and may be called
+// from several threads at once.
+class ChunkPool {
+public:
+  // chunk_vol and chunks_per_segment must be powers of two
+  ChunkPool(int32_t chunk_vol, int32_t max_chunks, int32_t chunks_per_segment=256);
+  ChunkPool() = default;
+  ChunkPool(ChunkPool&& other) noexcept { *this = std::move(other); }
+  ChunkPool& operator=(ChunkPool&& other) noexcept;
+  ChunkPool(const ChunkPool&) = delete;
+  ChunkPool& operator=(const ChunkPool&) = delete;
+  ~ChunkPool();
+
+  // Returns flat index of the first value of a new zeroed chunk
+  int32_t allocate();
+
+  inline float& operator[](int32_t idx) {
+    return segments[idx >> segment_shift].load(std::memory_order_relaxed)[idx & segment_mask];
+  }
+  inline const float& operator[](int32_t idx) const {
+    return segments[idx >> segment_shift].load(std::memory_order_relaxed)[idx & segment_mask];
+  }
+
+  int32_t chunks_used() const { return next_chunk; }
+  int32_t chunks_committed() const { return segments_committed*chunks_per_segment; }
+  size_t bytes_used() const { return (size_t)next_chunk*chunk_vol*sizeof(float); }
+  size_t bytes_committed() const { return (size_t)segments_committed*segment_sz*sizeof(float); }
+private:
+  std::vector<std::atomic<float*>> segments;
+  int32_t chunk_vol = 0;
+  int32_t chunks_per_segment = 0;
+  int32_t segment_sz = 0;
+  int32_t segment_shift = 0;
+  int32_t segment_mask = 0;
+  std::atomic<int32_t> next_chunk = 0;
+  std::atomic<int32_t> segments_committed = 0;
+};
@@ -4,10 +4,12 @@
 #include "rendering/mesh.h"
 #include "tree/implicit.h"
 #include "util/geometry.h"
+#include "util/ply_writer.h"
 #include <climits>
 #include <cmath>
 #include <glm/gtx/io.hpp>
 #include <iostream>
+#include <map>
 
 // Commonly used names
 using glm::ivec3;
@@ -17,18 +19,30 @@ using std::tuple;
 using std::vector;
 
 const float MB=1049000.f;
-void Grid::calc_data(){
+void Grid::calc_data(float threshold){
   std::cout<<"ACTUAL STATS"<<std::endl;
-  int occupied_chunks=0;
-  for (auto i : chunk_map){
-    if (i>=0) occupied_chunks++;
+  update_chunk_ranges();
+  int occupied_chunks=0, inside_chunks=0, outside_chunks=0;
+  for (int32_t c=0; c<chunk_map.size(); c++){
+    if (chunk_map[c].load(std::memory_order_relaxed)<0) continue;
+    occupied_chunks++;
+    if (threshold<0.f) continue;
+    if (chunk_range[c].min>threshold) inside_chunks++;
+    else if (chunk_range[c].max<=threshold) outside_chunks++;
   }
   std::cout<<"occupied_chunks: "<<occupied_chunks<<"/"<<chunk_map.size()<<" (" << (occupied_chunks/(float)chunk_map.size())*100.f << ")"<<std::endl;
-  float scalar_field_sz = scalar_field.size()*sizeof(float)/MB;
+  if (threshold>=0.f){
+    std::cout<<"chunks inside isosurface: "<<inside_chunks<<", outside: "<<outside_chunks
+             <<", on surface: "<<occupied_chunks-inside_chunks-outside_chunks<<std::endl;
+  }
+  float scalar_field_used = scalar_field.bytes_used()/MB;
+  float scalar_field_sz = scalar_field.bytes_committed()/MB;
   float chunk_map_sz = chunk_map.size()*sizeof(int32_t)/MB;
   std::cout<<"--------------------------------------------"<<std::endl;
-  std::cout<<"scalar_field: "<<scalar_field_sz<<"MB"<<std::endl;
+  std::cout<<"scalar_field used: "<<scalar_field_used<<"MB ("<<scalar_field.chunks_used()<<" chunks)"<<std::endl;
+  std::cout<<"scalar_field peak committed: "<<scalar_field_sz<<"MB ("<<scalar_field.chunks_committed()<<" chunks)"<<std::endl;
   std::cout<<"chunk_map "<<chunk_map_sz<<"MB"<<std::endl;
+  std::cout<<"chunk allocation collisions: "<<chunk_collisions<<std::endl;
   std::cout<<"TOTAL: "<<scalar_field_sz+chunk_map_sz<<"MB"<<std::endl;
   std::cout<<"--------------------------------------------"<<std::endl;
 }
@@ -41,27 +55,32 @@ Grid::Grid(const Skeleton &tree, float percent_overshoot, float scale_factor) {
     scale = tree.get_average_length() * scale_factor;
 
     dimensions = glm::ceil((front_top_right - back_bottom_left) / scale);
-    int32_t chunk_sz_3 = chunk_sz*chunk_sz*chunk_sz;
-    int32_t dim_sz=dimensions.x*dimensions.y*dimensions.z;
-    float compress_factor = 0.1;
-    int32_t compressed_sz = (1+(((int32_t)(dim_sz*compress_factor)-1)/chunk_sz_3))*chunk_sz_3;
-
-    scalar_field = vector<float>(compressed_sz,0.f);
 
     chunk_d = (dimensions/chunk_sz)+glm::ivec3(1,1,1);
-    chunk_map = std::vector<int32_t>(chunk_d.x*chunk_d.y*chunk_d.z, -2);
-    omp_init_lock(&chunk_map_lock);
+    chunk_map = std::vector<std::atomic<int32_t>>(chunk_d.x*chunk_d.y*chunk_d.z);
+    for (auto& chunk : chunk_map) chunk.store(-2, std::memory_order_relaxed);
+    chunk_range = std::vector<ChunkRange>(chunk_map.size());
+    range_stale = std::vector<std::atomic<bool>>(chunk_map.size());
+    mesh_dirty = std::vector<std::atomic<bool>>(chunk_map.size());
+    // Chunks are only committed once fill_line touches them
+    scalar_field = ChunkPool(chunk_sz*chunk_sz*chunk_sz, chunk_map.size());
 
     std::cout << "Grid dimensions: " << dimensions << std::endl;
 }
-Grid::~Grid() {
-    omp_destroy_lock(&chunk_map_lock);
-}
-
-void Grid::allocate_chunk(int32_t chunk_idx){
-  assert(next_chunk<scalar_field.size()); // better assert?
-  chunk_map[chunk_idx]=next_chunk;
-  next_chunk+=chunk_sz*chunk_sz*chunk_sz;
+int32_t Grid::claim_chunk(int32_t chunk_idx){
+  std::atomic<int32_t>& entry = chunk_map[chunk_idx];
+  int32_t loc = entry.load(std::memory_order_acquire);
+  if (loc>=0) return loc;
+  int32_t expected = -2;
+  if (entry.compare_exchange_strong(expected, -3, std::memory_order_acq_rel)){
+    loc = scalar_field.allocate();
+    entry.store(loc, std::memory_order_release);
+    return loc;
+  }
+  // Another thread claimed the chunk first, wait for it to publish
+  chunk_collisions.fetch_add(1, std::memory_order_relaxed);
+  while ((loc = entry.load(std::memory_order_acquire)) < 0);
+  return loc;
 }
 // ASSUMES CHUNK EXIST!!!
 int32_t Grid::get_chunk_idx(const glm::ivec3 p) const {
@@ -69,7 +88,7 @@ int32_t Grid::get_chunk_idx(const glm::ivec3 p) const {
   return chunk.x + chunk_d.x*chunk.y + chunk_d.x*chunk_d.y*chunk.z;
 }
 int32_t Grid::get_chunk_loc(const glm::ivec3 p) const {
-  return chunk_map[get_chunk_idx(p)];
+  return chunk_map[get_chunk_idx(p)].load(std::memory_order_acquire);
 }
 glm::ivec3 Grid::get_chunk_pos(const int32_t idx) const{
   const ivec3 chunk(
@@ -133,6 +152,83 @@ float Grid::eval_pos(glm::vec3 pos) const {
   return z0;
 }
 
+void Grid::eval_pos_batch(std::span<const glm::vec3> pos, std::span<float> vals) const {
+  assert(pos.size()==vals.size());
+  // Corners of a cell in the order eval_pos reads them, as offsets into a chunk
+  const int32_t corner_offset[8] = {
+    0, chunk_sz*chunk_sz, chunk_sz, chunk_sz+chunk_sz*chunk_sz,
+    1, 1+chunk_sz*chunk_sz, 1+chunk_sz, 1+chunk_sz+chunk_sz*chunk_sz,
+  };
+  // Lanes outside of any allocated chunk gather from here
+  static const float zeros[8*8*8] = {};
+  assert(corner_offset[7] < (int32_t)std::size(zeros));
+  // Runs on the calling thread, callers split their positions between threads
+  for (size_t start=0; start<pos.size(); start+=eval_block){
+    const int n = std::min<size_t>(eval_block, pos.size()-start);
+    alignas(64) float corner[8][eval_block];
+    alignas(64) float ix[eval_block], iy[eval_block], iz[eval_block];
+    alignas(64) int32_t chunk_idx[eval_block], offset[eval_block];
+    alignas(64) uint8_t one_chunk[eval_block];
+    alignas(64) const float* base[eval_block];
+    // Cells, weights and in chunk offsets of every lane
+    #pragma omp simd
+    for (int l=0; l<n; l++){
+      const vec3 p = pos[start+l];
+      const ivec3 bbl_cell = pos_to_grid(p);
+      const vec3 bbl_pos = grid_to_pos(bbl_cell);
+      const vec3 ftr_pos = grid_to_pos(bbl_cell+ivec3(1,1,1));
+      const vec3 interp = (p-bbl_pos)/(ftr_pos-bbl_pos);
+      ix[l] = interp.x; iy[l] = interp.y; iz[l] = interp.z;
+      const ivec3 in_chunk = bbl_cell%chunk_sz;
+      one_chunk[l] = is_in_grid(bbl_cell) & is_in_grid(bbl_cell+ivec3(1,1,1)) &
+          (in_chunk.x<chunk_sz-1) & (in_chunk.y<chunk_sz-1) & (in_chunk.z<chunk_sz-1);
+      chunk_idx[l] = get_chunk_idx(bbl_cell);
+      offset[l] = in_chunk.x + chunk_sz*in_chunk.y + chunk_sz*chunk_sz*in_chunk.z;
+    }
+    // Trials are close to each other, so remember the last chunk looked up
+    int32_t cached_chunk = -1;
+    const float* cached_base = zeros;
+    for (int l=0; l<n; l++){
+      if (one_chunk[l] && chunk_idx[l]!=cached_chunk){
+        cached_chunk = chunk_idx[l];
+        const int32_t loc = chunk_map[cached_chunk].load(std::memory_order_acquire);
+        cached_base = loc<0 ? zeros : &scalar_field[loc];
+      }
+      base[l] = one_chunk[l] ? cached_base : zeros;
+      if (base[l]==zeros) offset[l] = 0;
+    }
+    // A chunk's values are contiguous in its segment of the pool
+    for (int i=0; i<8; i++){
+      #pragma omp simd
+      for (int l=0; l<n; l++){
+        corner[i][l] = base[l][offset[l]+corner_offset[i]];
+      }
+    }
+    // Cells on a chunk or grid boundary
+    for (int l=0; l<n; l++){
+      if (one_chunk[l]) continue;
+      const ivec3 bbl_cell = pos_to_grid(pos[start+l]);
+      for (int i=0; i<8; i++){
+        corner[i][l] = lazy_eval(bbl_cell+ivec3(i>>2, (i>>1)&1, i&1));
+      }
+    }
+    // Same arithmetic as eval_pos so results match exactly
+    #pragma omp simd
+    for (int l=0; l<n; l++){
+      const float x = std::min(std::max(ix[l], 0.f), 1.f);
+      const float y = std::min(std::max(iy[l], 0.f), 1.f);
+      const float z = std::min(std::max(iz[l], 0.f), 1.f);
+      const float x0=(corner[4][l])*x+(corner[0][l])*(1.f-x);
+      const float x1=(corner[5][l])*x+(corner[1][l])*(1.f-x);
+      const float x2=(corner[6][l])*x+(corner[2][l])*(1.f-x);
+      const float x3=(corner[7][l])*x+(corner[3][l])*(1.f-x);
+      const float y0=x1*y+x0*(1.f-y);
+      const float y1=x3*y+x2*(1.f-y);
+      vals[start+l]=y1*z+y0*(1.f-z);
+    }
+  }
+}
+
 float Grid::lazy_eval(glm::ivec3 slot) const{
   int32_t idx = get_idx(slot);
   if (idx<0) return 0.f;
@@ -168,7 +264,8 @@ glm::vec3 Grid::eval_gradient(vec3 pos, float step_size) const {
 
 void Grid::fill_line(int32_t segment_index, 
     const std::vector<glm::vec3> &path, 
-    const std::vector<MetaBalls>& potential_funcs) {
+    const std::vector<MetaBalls>& potential_funcs,
+    Staging* staged) {
     MetaBalls implicit = potential_funcs[segment_index];
     glm::vec3 p1 = path[segment_index];
     glm::vec3 p2 = path[segment_index+1];
@@ -195,6 +292,9 @@ void Grid::fill_line(int32_t segment_index,
         d2 = n;
 
     vector<ivec3> voxels = get_voxels_line(segment_start, segment_end);
+    // Values are worked out first and added after, so staged fills know the
+    // segment's bounds before splatting
+    vector<std::pair<ivec3, float>> splats;
     glm::ivec3 init_slot = pos_to_grid(segment_start);
     int last_main_axis = init_slot[main_axis];
     int last_axis1 = init_slot[axis1];
@@ -211,8 +311,7 @@ void Grid::fill_line(int32_t segment_index,
                     ivec3 slot = voxels[i];
                     slot[axis1] += i1;
                     slot[axis2] += i2;
-                    int32_t s_idx=get_idx(slot);
-                    if (s_idx != -1) {
+                    if (is_in_grid(slot)) {
                       glm::vec3 grid_pos=grid_to_pos(slot);
                       float res=implicit.eval(grid_pos,p1,p2);
                       float res_bef= segment_index <= 0 ? 0.f : 
@@ -220,19 +319,7 @@ void Grid::fill_line(int32_t segment_index,
                       float res_aft= segment_index >= path.size()-2 ? 0.f : 
                         potential_funcs[segment_index+1].eval(grid_pos, path[segment_index+1], path[segment_index+2]);
                       if (res<res_bef || res<res_aft) continue;
-
-                      if (s_idx == -2){ // CHUNK NOT ALLOCATED
-                        omp_set_lock(&chunk_map_lock); 
-                        // double check to avoid data race
-                        if (get_chunk_loc(slot)==-2){ 
-                          allocate_chunk(get_chunk_idx(slot));
-                        }
-                        omp_unset_lock(&chunk_map_lock);
-                        s_idx = get_idx(slot);
-                      }
-
-                      #pragma omp atomic update
-                      scalar_field[s_idx]+=res;
+                      splats.push_back({slot, res});
                     }
                 }
             }
@@ -260,6 +347,22 @@ void Grid::fill_line(int32_t segment_index,
         last_axis1 = voxels[i][axis1];
         last_axis2 = voxels[i][axis2];
     }
+    if (staged){
+        stage(*staged, splats);
+        return;
+    }
+    for (auto [slot, res] : splats){
+        int32_t chunk_idx = get_chunk_idx(slot);
+        int32_t s_idx = get_idx(slot);
+        if (s_idx < 0){ // CHUNK NOT ALLOCATED
+          claim_chunk(chunk_idx);
+          s_idx = get_idx(slot);
+        }
+
+        #pragma omp atomic update
+        scalar_field[s_idx]+=res;
+        mark_filled(chunk_idx);
+    }
 }
 
 void Grid::fill_path(
@@ -281,12 +384,144 @@ void Grid::fill_path(
     potential_funcs.push_back(MetaBalls(max_val, b));
   }
 
+  if (fill_mode == Staged){
+    // Buffers belong to fixed blocks of segments rather than threads so the
+    // order values are summed in doesn't depend on the thread count
+    const int num_segments = path.size()-1;
+    const int num_blocks = (num_segments+staging_block-1)/staging_block;
+    staging.resize(std::max(staging.size(), (size_t)num_blocks));
+    for (int b = 0; b<num_blocks; b++) staging[b].clear();
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b<num_blocks; b++){
+      for (int i = b*staging_block; i<std::min((b+1)*staging_block, num_segments); i++){
+        fill_line(i, path, potential_funcs, &staging[b]);
+      }
+    }
+    merge_staging(num_blocks);
+    return;
+  }
+
   #pragma omp parallel for
   for (int i = 0; i<path.size()-1; i++){
     fill_line(i, path, potential_funcs);
   }
 }
 
+void Grid::stage(Staging& buffer, std::span<const std::pair<ivec3, float>> splats){
+  if (splats.empty()) return;
+  ivec3 lo = splats[0].first, hi = lo;
+  for (const auto& [slot, val] : splats){
+    lo = glm::min(lo, slot);
+    hi = glm::max(hi, slot);
+  }
+  Staging::Brick brick{lo, hi-lo+1, (int32_t)buffer.values.size()};
+  buffer.values.resize(buffer.values.size()+brick.size.x*brick.size.y*brick.size.z, 0.f);
+  float* values = &buffer.values[brick.offset];
+  const size_t first_chunk = buffer.chunks.size();
+  const int32_t brick_idx = buffer.bricks.size();
+  for (const auto& [slot, val] : splats){
+    const ivec3 local = slot-lo;
+    values[local.x + brick.size.x*(local.y + brick.size.y*local.z)] += val;
+    const int32_t chunk_idx = get_chunk_idx(slot);
+    if (buffer.chunks.size()==first_chunk || buffer.chunks.back().first!=chunk_idx)
+      buffer.chunks.push_back({chunk_idx, brick_idx});
+  }
+  // Only chunks actually splatted into get allocated, as with atomic fills
+  std::sort(buffer.chunks.begin()+first_chunk, buffer.chunks.end());
+  buffer.chunks.erase(std::unique(buffer.chunks.begin()+first_chunk, buffer.chunks.end()),
+      buffer.chunks.end());
+  buffer.bricks.push_back(brick);
+}
+
+void Grid::merge_staging(size_t num_buffers){
+  // Group the bricks by the chunks they overlap so each chunk is merged by
+  // one thread, in segment order
+  struct Entry{ int32_t chunk_idx; int32_t buffer; int32_t brick; };
+  vector<Entry> entries;
+  for (int32_t b = 0; b<num_buffers; b++){
+    for (auto [chunk_idx, brick] : staging[b].chunks) entries.push_back({chunk_idx, b, brick});
+  }
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b){
+      return std::tie(a.chunk_idx, a.buffer, a.brick) < std::tie(b.chunk_idx, b.buffer, b.brick);});
+  vector<size_t> group_starts;
+  for (size_t e = 0; e<entries.size(); e++){
+    if (e==0 || entries[e].chunk_idx!=entries[e-1].chunk_idx) group_starts.push_back(e);
+  }
+  group_starts.push_back(entries.size());
+
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (int g = 0; g<(int)group_starts.size()-1; g++){
+    const int32_t chunk_idx = entries[group_starts[g]].chunk_idx;
+    const ivec3 chunk_pos = get_chunk_pos(chunk_idx);
+    float* dst = &scalar_field[claim_chunk(chunk_idx)];
+    // Add the rows each brick shares with the chunk
+    for (size_t e = group_starts[g]; e<group_starts[g+1]; e++){
+      const Staging::Brick& brick = staging[entries[e].buffer].bricks[entries[e].brick];
+      const float* src = &staging[entries[e].buffer].values[brick.offset];
+      const ivec3 from = glm::max(brick.lo, chunk_pos);
+      const ivec3 to = glm::min(brick.lo+brick.size, chunk_pos+chunk_sz);
+      for (int z = from.z; z<to.z; z++){
+        for (int y = from.y; y<to.y; y++){
+          const ivec3 in_brick = ivec3(from.x, y, z)-brick.lo;
+          const ivec3 in_chunk = ivec3(from.x, y, z)-chunk_pos;
+          const float* row = src + in_brick.x + brick.size.x*(in_brick.y + brick.size.y*in_brick.z);
+          float* dst_row = dst + in_chunk.x + chunk_sz*(in_chunk.y + chunk_sz*in_chunk.z);
+          for (int x = 0; x<to.x-from.x; x++) dst_row[x] += row[x];
+        }
+      }
+    }
+    // This thread is the chunk's only writer, so its range can be kept exact
+    set_chunk_range(chunk_idx, dst);
+    mesh_dirty[chunk_idx].store(true, std::memory_order_relaxed);
+  }
+}
+
+void Grid::mark_filled(int32_t chunk_idx){
+  // Checked first so the flags' cache lines stay shared
+  if (!range_stale[chunk_idx].load(std::memory_order_relaxed))
+    range_stale[chunk_idx].store(true, std::memory_order_relaxed);
+  if (!mesh_dirty[chunk_idx].load(std::memory_order_relaxed))
+    mesh_dirty[chunk_idx].store(true, std::memory_order_relaxed);
+}
+
+void Grid::set_chunk_range(int32_t chunk_idx, const float* values){
+  const int32_t chunk_vol = chunk_sz*chunk_sz*chunk_sz;
+  float lo = values[0], hi = values[0];
+  #pragma omp simd reduction(min:lo) reduction(max:hi)
+  for (int32_t v = 1; v<chunk_vol; v++){
+    lo = std::min(lo, values[v]);
+    hi = std::max(hi, values[v]);
+  }
+  chunk_range[chunk_idx] = {lo, hi};
+  range_stale[chunk_idx].store(false, std::memory_order_relaxed);
+}
+
+void Grid::update_chunk_ranges(){
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int32_t c = 0; c<(int32_t)chunk_map.size(); c++){
+    if (!range_stale[c].load(std::memory_order_relaxed)) continue;
+    set_chunk_range(c, &scalar_field[chunk_map[c].load(std::memory_order_acquire)]);
+  }
+}
+
+bool Grid::chunk_homogeneous(int32_t chunk_idx, float threshold) const {
+  // Cells reach one voxel into the next chunk on each axis, so those chunks
+  // have to be on the same side of the surface too
+  const ivec3 chunk = get_chunk_pos(chunk_idx)/chunk_sz;
+  bool inside = true, outside = true;
+  for (int i = 0; i<8; i++){
+    const ivec3 n = chunk+ivec3(i&1, (i>>1)&1, i>>2);
+    ChunkRange range; // Missing chunks are all zero
+    if (n.x<chunk_d.x && n.y<chunk_d.y && n.z<chunk_d.z){
+      const int32_t n_idx = n.x + chunk_d.x*n.y + chunk_d.x*chunk_d.y*n.z;
+      if (chunk_map[n_idx].load(std::memory_order_relaxed)>=0) range = chunk_range[n_idx];
+    }
+    inside = inside && range.min>threshold;
+    outside = outside && range.max<=threshold;
+  }
+  return inside || outside;
+}
+
 vector<ivec3> Grid::get_voxels_line(vec3 start, vec3 end) const {
     // Initialize voxel list
     vector<ivec3> voxel_list;
@@ -379,50 +614,283 @@ Mesh<VertFlat> Grid::get_normals_geom(float threshold) {
     return Mesh<VertFlat>(vertices, indices);
 }
 
-Mesh<Vertex> Grid::get_occupied_geom(float threshold) {
-    using namespace mc;
-    vector<Vertex> verts;
-    vector<GLuint> indices;
+vector<int32_t> Grid::surface_chunks(float threshold) {
+    update_chunk_ranges();
+    // Chunks not initialized are known to be empty, and chunks entirely on
+    // one side of the surface have nothing to polygonize
+    vector<int32_t> chunks;
     for (int32_t chunk_idx=0; chunk_idx<chunk_map.size(); chunk_idx++){
-      if (chunk_map[chunk_idx]<0) continue; // Chunk not initialized so we know its empty
-      ivec3 chunk_pos=get_chunk_pos(chunk_idx);
-      for(int idx=0;idx<chunk_sz*chunk_sz*chunk_sz; idx++){
-        ivec3 offset(
-            (idx%(chunk_sz*chunk_sz))%chunk_sz,
-            (idx%(chunk_sz*chunk_sz))/chunk_sz,
-            idx/(chunk_sz*chunk_sz));
-        ivec3 voxel=chunk_pos+offset;
-
-        ivec3 slots[8];
-        vec3 cell_pos[8];
-        for (int i=0; i<8; i++){
-            slots[i]=voxel+cell_order[i];
-            cell_pos[i]=grid_to_pos(slots[i]);
-        }
+      if (chunk_map[chunk_idx].load(std::memory_order_relaxed)<0) continue;
+      if (chunk_homogeneous(chunk_idx, threshold)) continue;
+      chunks.push_back(chunk_idx);
+    }
+    return chunks;
+}
 
-        // If completely full or empty don't check
-        if (std::all_of(slots, slots+8, [&](const ivec3 slot){
-              return lazy_eval(slot) >= threshold;})) continue;
-        if (std::all_of(slots, slots+8, [&](const ivec3 slot){
-              return lazy_eval(slot) <= 0.f;})) continue;
-
-        GridCell cell = {{
-            { .pos=cell_pos[0],.norm=lazy_norm(slots[0]),.val=lazy_eval(slots[0])},
-            { .pos=cell_pos[1],.norm=lazy_norm(slots[1]),.val=lazy_eval(slots[1])},
-            { .pos=cell_pos[2],.norm=lazy_norm(slots[2]),.val=lazy_eval(slots[2])},
-            { .pos=cell_pos[3],.norm=lazy_norm(slots[3]),.val=lazy_eval(slots[3])},
-            { .pos=cell_pos[4],.norm=lazy_norm(slots[4]),.val=lazy_eval(slots[4])},
-            { .pos=cell_pos[5],.norm=lazy_norm(slots[5]),.val=lazy_eval(slots[5])},
-            { .pos=cell_pos[6],.norm=lazy_norm(slots[6]),.val=lazy_eval(slots[6])},
-            { .pos=cell_pos[7],.norm=lazy_norm(slots[7]),.val=lazy_eval(slots[7])},
-        }};
-        polygonize(cell, threshold, verts, indices);
+Grid::Extraction Grid::extract_fragments(float threshold) {
+    Extraction extraction;
+    vector<int32_t>& chunks = extraction.chunks;
+    chunks = surface_chunks(threshold);
+    // A chunk's cells and normals read one voxel into each neighbour, and
+    // edge ownership depends on which neighbours are allocated, so chunks
+    // next to a filled one are polygonized again too
+    if (threshold != mesh_cache_threshold){
+      mesh_cache.clear();
+      mesh_cache_threshold = threshold;
+    }
+    vector<uint8_t> remesh(chunk_map.size(), 0);
+    for (int32_t chunk_idx=0; chunk_idx<chunk_map.size(); chunk_idx++){
+      if (!mesh_dirty[chunk_idx].load(std::memory_order_relaxed)) continue;
+      mesh_dirty[chunk_idx].store(false, std::memory_order_relaxed);
+      const ivec3 chunk = get_chunk_pos(chunk_idx)/chunk_sz;
+      for (int i=0; i<27; i++){
+        const ivec3 n = chunk+ivec3(i%3-1, (i/3)%3-1, i/9-1);
+        if (glm::any(glm::lessThan(n, ivec3(0))) || glm::any(glm::greaterThanEqual(n, chunk_d))) continue;
+        remesh[n.x + chunk_d.x*n.y + chunk_d.x*chunk_d.y*n.z] = 1;
       }
     }
+    // Entries are made up front so the parallel loop doesn't touch the map
+    vector<MeshFragment*> fragments(chunks.size());
+    vector<size_t> todo;
+    for (size_t i=0; i<chunks.size(); i++){
+      auto [it, inserted] = mesh_cache.try_emplace(chunks[i]);
+      fragments[i] = &it->second;
+      if (inserted || remesh[chunks[i]]) todo.push_back(i);
+    }
+    std::erase_if(mesh_cache, [&](const auto& entry){
+        return !std::binary_search(chunks.begin(), chunks.end(), entry.first);});
+    // Polygonize every chunk on its own, indices are local to the chunk
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t t=0; t<todo.size(); t++){
+      polygonize_chunk(chunks[todo[t]], threshold, *fragments[todo[t]]);
+    }
+    std::cout<<"Polygonized "<<todo.size()<<"/"<<chunks.size()<<" chunks"<<std::endl;
+    // Fragments are placed back to back in chunk order
+    extraction.fragments.assign(fragments.begin(), fragments.end());
+    extraction.vert_offsets.assign(fragments.size()+1, 0);
+    extraction.index_offsets.assign(fragments.size()+1, 0);
+    for (size_t i=0; i<fragments.size(); i++){
+      extraction.vert_offsets[i+1] = extraction.vert_offsets[i]+fragments[i]->verts.size();
+      extraction.index_offsets[i+1] = extraction.index_offsets[i]+fragments[i]->indices.size();
+    }
+    return extraction;
+}
+
+void Grid::resolve_indices(const MeshFragment& fragment, GLuint base,
+    std::span<const GLuint> borrowed, GLuint* out) const {
+    for (size_t j=0; j<fragment.indices.size(); j++){
+      GLuint local = fragment.indices[j];
+      out[j] = (local & borrowed_vertex) ?
+        borrowed[local & ~borrowed_vertex] : base+local;
+    }
+}
+
+GLuint Grid::shared_vertex(std::span<const std::pair<uint64_t, GLuint>> shared, uint64_t key) {
+    auto it = std::lower_bound(shared.begin(), shared.end(), std::make_pair(key, (GLuint)0));
+    assert(it!=shared.end() && it->first==key);
+    return it->second;
+}
+
+void Grid::resolve_indices(const Extraction& extraction, size_t i, GLuint* out) const {
+    const MeshFragment& fragment = *extraction.fragments[i];
+    const vector<int32_t>& chunks = extraction.chunks;
+    // Look borrowed vertices up in the owning chunk's fragment
+    vector<GLuint> borrowed(fragment.borrowed.size());
+    for (size_t j=0; j<fragment.borrowed.size(); j++){
+      const EdgeRef& ref = fragment.borrowed[j];
+      size_t owner = std::lower_bound(chunks.begin(), chunks.end(), ref.chunk)-chunks.begin();
+      borrowed[j] = extraction.vert_offsets[owner]+shared_vertex(extraction.fragments[owner]->shared, ref.key);
+    }
+    resolve_indices(fragment, extraction.vert_offsets[i], borrowed, out);
+}
+
+Mesh<Vertex> Grid::get_occupied_geom(float threshold) {
+    Extraction extraction = extract_fragments(threshold);
+    const auto& fragments = extraction.fragments;
+    vector<Vertex> verts(extraction.vert_offsets.back());
+    vector<GLuint> indices(extraction.index_offsets.back());
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (size_t i=0; i<fragments.size(); i++){
+      std::copy(fragments[i]->verts.begin(), fragments[i]->verts.end(),
+          verts.begin()+extraction.vert_offsets[i]);
+      resolve_indices(extraction, i, indices.data()+extraction.index_offsets[i]);
+    }
     std::cout<<"VERTS: " <<verts.size()<<" TRIS: "<<indices.size()/3<<std::endl;
     return Mesh<Vertex>(verts,indices);
 }
 
+void Grid::save_occupied_geom(float threshold, const std::string& filename, glm::mat4 pos_transform) {
+    // Independent of mesh_cache: chunks are polygonized a block at a time,
+    // written and dropped, so the mesh is never held in memory
+    vector<int32_t> chunks = surface_chunks(threshold);
+    PlyWriter ply(filename, pos_transform);
+    // A chunk only borrows from chunks at most one step lower in two axes,
+    // so shared vertices are kept for a window of one slab of chunks
+    const int32_t window = chunk_d.x*chunk_d.y+chunk_d.x;
+    struct Owner{
+      GLuint vert_offset;
+      vector<std::pair<uint64_t, GLuint>> shared;
+    };
+    std::map<int32_t, Owner> owners;
+    constexpr size_t block = 64;
+    vector<MeshFragment> fragments(std::min(block, chunks.size()));
+    vector<GLuint> borrowed, indices;
+    for (size_t start=0; start<chunks.size(); start+=block){
+      size_t size = std::min(block, chunks.size()-start);
+      #pragma omp parallel for schedule(dynamic)
+      for (size_t i=0; i<size; i++){
+        polygonize_chunk(chunks[start+i], threshold, fragments[i]);
+      }
+      for (size_t i=0; i<size; i++){
+        int32_t chunk_idx = chunks[start+i];
+        MeshFragment& fragment = fragments[i];
+        while (!owners.empty() && owners.begin()->first < chunk_idx-window)
+          owners.erase(owners.begin());
+        borrowed.resize(fragment.borrowed.size());
+        for (size_t j=0; j<fragment.borrowed.size(); j++){
+          const EdgeRef& ref = fragment.borrowed[j];
+          auto it = owners.find(ref.chunk);
+          assert(it!=owners.end());
+          borrowed[j] = it->second.vert_offset+shared_vertex(it->second.shared, ref.key);
+        }
+        GLuint base = ply.get_num_vertices();
+        indices.resize(fragment.indices.size());
+        resolve_indices(fragment, base, borrowed, indices.data());
+        ply.write_vertices(fragment.verts);
+        ply.write_faces(indices);
+        owners[chunk_idx] = {base, std::move(fragment.shared)};
+      }
+    }
+    ply.close();
+    std::cout<<"VERTS: " <<ply.get_num_vertices()<<" TRIS: "<<ply.get_num_faces()<<std::endl;
+}
+
+// Marching Cubes
+// BOURKE, P., 1994. Polygonising a Scalar Field (accessed on May 16, 2023). URL: http://paulbourke.net/geometry/polygonise/
+void Grid::polygonize_chunk(int32_t chunk_idx, float threshold, MeshFragment& fragment) {
+    using namespace mc;
+    fragment.verts.clear();
+    fragment.indices.clear();
+    fragment.shared.clear();
+    fragment.borrowed.clear();
+    ivec3 chunk_pos=get_chunk_pos(chunk_idx);
+    int32_t chunk_loc=chunk_map[chunk_idx].load(std::memory_order_relaxed);
+    // Copy the chunk and a 1 voxel halo into one block so each value is only
+    // looked up once
+    const int halo = chunk_sz+3;
+    vector<float> block(halo*halo*halo);
+    auto block_val = [&](ivec3 local) -> float& {
+      return block[((local.z+1)*halo+local.y+1)*halo+local.x+1];
+    };
+    for (int z=-1; z<chunk_sz+2; z++){
+      for (int y=-1; y<chunk_sz+2; y++){
+        for (int x=-1; x<chunk_sz+2; x++){
+          bool inside = x>=0 && x<chunk_sz && y>=0 && y<chunk_sz && z>=0 && z<chunk_sz;
+          block_val(ivec3(x,y,z)) = inside ?
+            scalar_field[chunk_loc+x+chunk_sz*y+chunk_sz*chunk_sz*z] :
+            lazy_eval(chunk_pos+ivec3(x,y,z));
+        }
+      }
+    }
+    // Normals at every cell corner from central differences, as lazy_norm
+    const int span = chunk_sz+1;
+    vector<vec3> norms(span*span*span);
+    for (int z=0; z<span; z++){
+      for (int y=0; y<span; y++){
+        for (int x=0; x<span; x++){
+          ivec3 p(x,y,z);
+          vec3 gradient(
+              block_val(p-ivec3(1,0,0))-block_val(p+ivec3(1,0,0)),
+              block_val(p-ivec3(0,1,0))-block_val(p+ivec3(0,1,0)),
+              block_val(p-ivec3(0,0,1))-block_val(p+ivec3(0,0,1)));
+          norms[(z*span+y)*span+x] = glm::normalize(gradient);
+        }
+      }
+    }
+    // Vertex of every edge starting in the chunk or on its far faces, indexed
+    // by the edge's local origin and axis
+    vector<GLuint> edge_verts(span*span*span*3, UINT_MAX);
+    for(int idx=0;idx<chunk_sz*chunk_sz*chunk_sz; idx++){
+      ivec3 offset(
+          (idx%(chunk_sz*chunk_sz))%chunk_sz,
+          (idx%(chunk_sz*chunk_sz))/chunk_sz,
+          idx/(chunk_sz*chunk_sz));
+
+      ivec3 corners[8];
+      int cubeindex = 0;
+      for (int i=0; i<8; i++){
+          corners[i]=offset+cell_order[i];
+          if (block_val(corners[i]) > threshold) cubeindex |= 1 << i;
+      }
+      // Fully in/out of isosurface
+      if (edge_table[cubeindex] == 0) continue;
+
+      GridCell cell;
+      for (int i=0; i<8; i++){
+          const ivec3& c = corners[i];
+          cell[i] = { .pos=grid_to_pos(chunk_pos+c),
+                      .norm=norms[(c.z*span+c.y)*span+c.x],
+                      .val=block_val(c)};
+      }
+
+      // Find the vertex on each crossed edge
+      GLuint vertlist[12];
+      for (int e=0; e<12; e++){
+        if (!(edge_table[cubeindex] & 1 << e)) continue;
+        int a = edge_corners[e][0], b = edge_corners[e][1];
+        // Always interpolate up the axis so every cell sharing the edge
+        // agrees on its vertex
+        if (glm::any(glm::greaterThan(cell_order[a], cell_order[b]))) std::swap(a, b);
+        ivec3 origin = offset+cell_order[a];
+        ivec3 dir = cell_order[b]-cell_order[a];
+        int axis = dir.x ? 0 : dir.y ? 1 : 2;
+        GLuint& vert = edge_verts[((origin.z*span+origin.y)*span+origin.x)*3+axis];
+        if (vert == UINT_MAX){
+          vert = edge_vertex(chunk_idx, chunk_pos+origin, axis, cell[a], cell[b], threshold, fragment);
+        }
+        vertlist[e] = vert;
+      }
+
+      // Add Indices
+      for (int i = 0; tri_table[cubeindex][i] != -1; i += 3) {
+          fragment.indices.push_back(vertlist[tri_table[cubeindex][i]]);
+          fragment.indices.push_back(vertlist[tri_table[cubeindex][i+1]]);
+          fragment.indices.push_back(vertlist[tri_table[cubeindex][i+2]]);
+      }
+    }
+    std::sort(fragment.shared.begin(), fragment.shared.end());
+}
+
+GLuint Grid::edge_vertex(int32_t chunk_idx, ivec3 origin, int axis,
+    const Sample& lower, const Sample& upper, float threshold, MeshFragment& fragment) const {
+    // The edge is shared with other chunks if a cell behind it is in one
+    ivec3 extent = chunk_d*chunk_sz+1;
+    uint64_t key = (((uint64_t)origin.z*extent.y+origin.y)*extent.x+origin.x)*3+axis;
+    int b0 = (axis+1)%3, b1 = (axis+2)%3;
+    bool shared = origin[b0]%chunk_sz==0 || origin[b1]%chunk_sz==0;
+    if (shared){
+      int32_t owner = chunk_idx;
+      for (int d=1; d<4; d++){
+        ivec3 cell = origin;
+        cell[b0] -= d&1;
+        cell[b1] -= d>>1;
+        if (cell[b0]<0 || cell[b1]<0) continue;
+        int32_t neighbour = get_chunk_idx(cell);
+        if (neighbour<owner && chunk_map[neighbour].load(std::memory_order_relaxed)>=0){
+          owner = neighbour;
+        }
+      }
+      if (owner != chunk_idx){
+        fragment.borrowed.push_back({owner, key});
+        return borrowed_vertex | (GLuint)(fragment.borrowed.size()-1);
+      }
+    }
+    GLuint local = fragment.verts.size();
+    fragment.verts.push_back(vertex_interp(threshold, lower, upper));
+    if (shared) fragment.shared.push_back({key, local});
+    return local;
+}
+
 Mesh<VertFlat> Grid::get_bound_geom() const {
     vector<VertFlat> vertices;
     vector<GLuint> indices = {0, 1, 2, 3, 4, 5, 6, 7, 0, 2, 1, 3,
@@ -502,50 +970,6 @@ Mesh<VertFlat> Grid::get_grid_geom() const {
     return Mesh(vertices, indices);
 }
 
-// Marching Cubes
-// BOURKE, P., 1994. Polygonising a Scalar Field (accessed on May 16, 2023). URL: http://paulbourke.net/geometry/polygonise/
-void Grid::polygonize(const GridCell& cell, float threshold, vector<Vertex>& verts, vector<GLuint>& indices) const{
-    using namespace mc;
-    int i;
-    int cubeindex;
-    struct vert_index{
-        Vertex v;
-        GLuint i;
-    };
-    vert_index vertlist[12];
-
-    // Find index
-    cubeindex = 0;
-    for (int i = 0; i < 8; i++) {
-        if (cell[i].val > threshold) cubeindex |= 1 << i;
-    }
-
-    // Fully in/out of isosurface
-    if (edge_table[cubeindex] == 0) return;
-
-    // Add Vertices
-    // TODO: Change this too loop instead of macros
-    int N = 0, current_index = verts.size();
-#define FINDVERT(A, B)                                                         \
-    if (edge_table[cubeindex] & 1 << N) {                                      \
-        vertlist[N].v = vertex_interp(threshold, cell[A], cell[B]);            \
-        vertlist[N].i = current_index;                                         \
-        verts.push_back(vertlist[N].v);                                        \
-        current_index++;                                                       \
-    }                                                                          \
-    N++
-
-    FINDVERT(0,1); FINDVERT(1,2); FINDVERT(2,3); FINDVERT(3,0); // Bottom Edges
-    FINDVERT(4,5); FINDVERT(5,6); FINDVERT(6,7); FINDVERT(7,4); // Top Edges
-    FINDVERT(0,4); FINDVERT(1,5); FINDVERT(2,6); FINDVERT(3,7); // Middle Edges
-
-    // Add Indices
-    for (i = 0; tri_table[cubeindex][i] != -1; i += 3) {
-        indices.push_back(vertlist[tri_table[cubeindex][i]].i);
-        indices.push_back(vertlist[tri_table[cubeindex][i+1]].i);
-        indices.push_back(vertlist[tri_table[cubeindex][i+2]].i);
-    }
-}
 Vertex Grid::vertex_interp(float threshold, const Grid::Sample& a, const Grid::Sample& b) const{
     vec3 col0(.25,.25,.25);
     Vertex v = {vec3(),vec3(),vec3()};
@@ -572,6 +996,13 @@ const ivec3 mc::cell_order[8] = {
     ivec3(1, 1, 0), ivec3(1, 1, 1), ivec3(0, 1, 1), ivec3(0, 1, 0),
 };
 
+// Corners at the ends of each edge, in edge_table bit order
+const int mc::edge_corners[12][2] = {
+    {0, 1}, {1, 2}, {2, 3}, {3, 0}, // Bottom Edges
+    {4, 5}, {5, 6}, {6, 7}, {7, 4}, // Top Edges
+    {0, 4}, {1, 5}, {2, 6}, {3, 7}, // Middle Edges
+};
+
 const int mc::edge_table[256] = {
     0x0,   0x109, 0x203, 0x30a, 0x406, 0x50f, 0x605, 0x70c, 0x80c, 0x905, 0xa0f,
     0xb06, 0xc0a, 0xd03, 0xe09, 0xf00, 0x190, 0x99,  0x393, 0x29a, 0x596, 0x49f,
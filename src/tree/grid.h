@@ -2,10 +2,14 @@
 
 #include <vector>
 #include <array>
+#include <span>
+#include <string>
 #include <tuple>
 #include <limits>
 #include <algorithm>
 #include <unordered_set>
+#include <unordered_map>
+#include <atomic>
 #include <omp.h>
 
 #include <glad/glad.h>
@@ -22,26 +26,38 @@
 #include "rendering/VBO.h"
 #include "tree/skeleton.h"
 #include "tree/implicit.h"
+#include "tree/chunk_pool.h"
 
 class Grid
 {
+    struct Staging;
 public:
     Grid(const Skeleton& tree, float percent_overshoot, float scale_factor=1.f);
-    ~Grid();
 
     float get_scale() { return scale; }
     glm::vec3 get_center() { return center; }
     glm::vec3 get_backbottomleft() { return back_bottom_left; }
 
     // Implicit Filling
+    enum FillMode{
+        Atomic, // Add straight into the field with omp atomics
+        Staged, // Splat each segment into a private dense brick, then merge
+                // them chunk by chunk. Same result on any number of threads
+    };
+    void set_fill_mode(FillMode mode) { fill_mode = mode; }
     void fill_path(uint32_t strand_id, const std::vector<glm::vec3> &path, 
         float max_val, float max_b, float shoot_b, float root_b, 
         size_t inflection_point);
     void fill_line(int32_t segment_index, 
         const std::vector<glm::vec3> &path, 
-        const std::vector<MetaBalls>& potential_funcs);
+        const std::vector<MetaBalls>& potential_funcs,
+        Staging* staged=nullptr);
 
     float eval_pos(glm::vec3 pos) const;
+    // Same as eval_pos on every position, gathering and interpolating in
+    // SIMD lanes, eval_block positions at a time
+    void eval_pos_batch(std::span<const glm::vec3> pos, std::span<float> vals) const;
+    static constexpr int eval_block = 64;
     float lazy_eval(glm::ivec3 slot) const;
     glm::vec3 lazy_gradient(glm::ivec3 slot);
     glm::vec3 lazy_norm(glm::ivec3 slot);
@@ -57,19 +73,45 @@ public:
     Mesh<VertFlat> get_grid_geom() const;
     Mesh<VertFlat> get_bound_geom() const;
     Mesh<Vertex> get_occupied_geom(float threshold);
+    // Streams the isosurface to a binary PLY a block of chunks at a time,
+    // keeping only the shared vertices of the last slab of chunks
+    void save_occupied_geom(float threshold, const std::string& filename,
+        glm::mat4 pos_transform = glm::mat4(1));
     Mesh<VertFlat> get_normals_geom(float threshold);
-    void calc_data();
+    // Prints memory use, and how many chunks the isosurface can pass through
+    // if threshold is given
+    void calc_data(float threshold=-1.f);
 private:
     struct Eval {
         float val   = 0.0;
         size_t checked = 0;
         std::unordered_map<uint32_t, float> strands_checked;
     };
+    // Private values of a block of segments for FillMode::Staged. Each
+    // segment gets a dense brick just big enough for the voxels it fills
+    struct Staging {
+        struct Brick {
+            glm::ivec3 lo;
+            glm::ivec3 size;
+            int32_t offset; // into values
+        };
+        std::vector<Brick> bricks;
+        std::vector<float> values;
+        // (chunk_idx, brick) for every chunk a brick splatted into
+        std::vector<std::pair<int32_t, int32_t>> chunks;
+        void clear() { bricks.clear(); values.clear(); chunks.clear(); }
+    };
+    FillMode fill_mode = Atomic;
+    std::vector<Staging> staging;
+    void stage(Staging& buffer, std::span<const std::pair<glm::ivec3, float>> splats);
+    void merge_staging(size_t num_buffers);
+    static constexpr int staging_block = 16;
 
     int32_t get_idx(glm::ivec3 v) const;
-    std::vector<float> scalar_field;
+    ChunkPool scalar_field;
 
-    void allocate_chunk(int32_t chunk_idx);
+    // Lock-free: returns the chunk's location, allocating it if needed
+    int32_t claim_chunk(int32_t chunk_idx);
     // Returns Chunk's Index in chunk_map
     int32_t get_chunk_idx(const glm::ivec3 p) const;
     // Returns Chunk's location in scalar field data vector
@@ -77,9 +119,25 @@ private:
     // Returns Chunk's back bottom left world position
     glm::ivec3 get_chunk_pos(const int32_t idx) const;
     const int chunk_sz=8;
-    omp_lock_t chunk_map_lock;
-    std::vector<int32_t> chunk_map;
-    int32_t next_chunk=0;
+    // Chunk location in scalar_field, -2 if not allocated, -3 while a thread
+    // is allocating it
+    std::vector<std::atomic<int32_t>> chunk_map;
+    std::atomic<uint64_t> chunk_collisions=0;
+    // Value range of each chunk. Staged merges keep it exact, atomic fills
+    // only mark the chunk stale and update_chunk_ranges recomputes it.
+    struct ChunkRange{
+      float min = 0.f;
+      float max = 0.f;
+    };
+    std::vector<ChunkRange> chunk_range;
+    std::vector<std::atomic<bool>> range_stale;
+    // Chunks filled since they were last polygonized
+    std::vector<std::atomic<bool>> mesh_dirty;
+    void mark_filled(int32_t chunk_idx);
+    void update_chunk_ranges();
+    void set_chunk_range(int32_t chunk_idx, const float* values);
+    // True if no cell of the chunk can have the isosurface pass through it
+    bool chunk_homogeneous(int32_t chunk_idx, float threshold) const;
     glm::ivec3 chunk_d;
 
     glm::ivec3 dimensions;
@@ -103,7 +161,46 @@ private:
     float val;
   };
   using GridCell = std::array<Sample,8>;
-  void polygonize(const GridCell &cell, float threshold, std::vector<Vertex> &verts, std::vector<GLuint> &indices) const;
+  // Mesh of a single chunk, indices start at 0. Edges shared with other
+  // chunks get their vertex from the lowest allocated chunk touching them,
+  // the others borrow it.
+  struct EdgeRef{
+    int32_t chunk;
+    uint64_t key;
+  };
+  struct MeshFragment{
+    std::vector<Vertex> verts;
+    std::vector<GLuint> indices;
+    std::vector<std::pair<uint64_t, GLuint>> shared; // sorted edge key -> vertex
+    std::vector<EdgeRef> borrowed;
+  };
+  // Marks an index into MeshFragment::borrowed instead of verts
+  static constexpr GLuint borrowed_vertex = 1u<<31;
+  void polygonize_chunk(int32_t chunk_idx, float threshold, MeshFragment& fragment);
+  // Allocated chunks the surface passes through, in order
+  std::vector<int32_t> surface_chunks(float threshold);
+  // Fragments from the last extraction, only chunks near filled ones are
+  // polygonized again. Only get_occupied_geom fills it, exports don't
+  std::unordered_map<int32_t, MeshFragment> mesh_cache;
+  float mesh_cache_threshold = -1.f;
+  // Fragments with surface in chunk order, and where each one's vertices and
+  // indices start in the whole mesh
+  struct Extraction{
+    std::vector<int32_t> chunks;
+    std::vector<const MeshFragment*> fragments;
+    std::vector<size_t> vert_offsets;
+    std::vector<size_t> index_offsets;
+  };
+  Extraction extract_fragments(float threshold);
+  // Fragment i's indices into the whole mesh, borrowed vertices resolved
+  void resolve_indices(const Extraction& extraction, size_t i, GLuint* out) const;
+  // Same given where the fragment's vertices start and each borrowed vertex
+  void resolve_indices(const MeshFragment& fragment, GLuint base,
+      std::span<const GLuint> borrowed, GLuint* out) const;
+  // Owner's vertex on a shared edge
+  static GLuint shared_vertex(std::span<const std::pair<uint64_t, GLuint>> shared, uint64_t key);
+  GLuint edge_vertex(int32_t chunk_idx, glm::ivec3 origin, int axis,
+      const Sample& lower, const Sample& upper, float threshold, MeshFragment& fragment) const;
   Vertex vertex_interp(float threshold, const Sample& a, const Sample& b) const; 
 
 };
@@ -112,4 +209,5 @@ namespace mc{
   extern const glm::ivec3 cell_order[8];
   extern const int edge_table[256];
   extern const int tri_table[256][16];
+  extern const int edge_corners[12][2];
 };
@@ -1,81 +1,122 @@
 #include "kdtree.h"
 #include "glm/gtx/norm.hpp"
-#include "glm/gtx/io.hpp"
 #include <algorithm>
+#include <cassert>
+#include <limits>
 #include <numeric>
-#include <iostream>
-#include <cfloat>
 
-KDTree::KDTree(std::shared_ptr<std::vector<glm::vec2>> p) : points(p) {
-  std::vector<int32_t>buff(points->size());
-  tree = std::vector<KDTreeNode>(points->size());
-  std::iota(buff.begin(), buff.end(), 0);
-  root = buildKDTree(buff, 0, buff.size(), true);
-  for (int i=0;i<tree.size();i++){ 
-    assert(i==root||tree[i].parent!=-1); 
-    assert(tree[i].left==-1||tree[tree[i].left].parent==i);
-    assert(tree[i].right==-1||tree[tree[i].right].parent==i);
-  }
+KDTree::KDTree(std::span<const glm::vec3> p) {
+  assert(p.size() <= std::numeric_limits<int32_t>::max());
+  points.assign(p.begin(), p.end());
+  ids = std::vector<int32_t>(points.size());
+  axes = std::vector<uint8_t>(points.size());
+  std::iota(ids.begin(), ids.end(), 0);
+  build(0, points.size());
+  // Points were only moved through ids, put them in tree order
+  for (size_t i = 0; i < ids.size(); i++) points[i] = p[ids[i]];
 }
-int32_t KDTree::buildKDTree(std::vector<int32_t> &buffer, int32_t start, int32_t end, int32_t level){
-  if (start>=end) return -1;
-  auto cmp = [&](int32_t a ,int32_t b){
-    return level%2==0 ? 
-      (*points)[a].x < (*points)[b].x:
-      (*points)[a].y < (*points)[b].y;
-  };
-  std::sort(buffer.begin()+start, buffer.begin()+end, cmp);
-  int32_t buff_idx = start+(end-start)/2;
-  int32_t node_idx = buffer[buff_idx];
 
-  tree[node_idx].level=level;
-  tree[node_idx].left=buildKDTree(buffer, start, buff_idx, level+1);
-  tree[node_idx].right=buildKDTree(buffer, buff_idx+1, end, level+1);
+// Splits on the widest axis of the range, nth_element keeps each level O(n)
+void KDTree::build(int32_t lo, int32_t hi) {
+  if (hi - lo <= 1) return;
+  glm::vec3 lb = points[ids[lo]], ub = lb;
+  for (int32_t i = lo + 1; i < hi; i++) {
+    lb = glm::min(lb, points[ids[i]]);
+    ub = glm::max(ub, points[ids[i]]);
+  }
+  glm::vec3 extent = ub - lb;
+  uint8_t axis = extent.x >= extent.y ? (extent.x >= extent.z ? 0 : 2)
+                                      : (extent.y >= extent.z ? 1 : 2);
+  int32_t mid = lo + (hi - lo)/2;
+  std::nth_element(ids.begin() + lo, ids.begin() + mid, ids.begin() + hi,
+      [&](int32_t a, int32_t b){ return points[a][axis] < points[b][axis]; });
+  axes[mid] = axis;
+  build(lo, mid);
+  build(mid + 1, hi);
+}
 
-  if(tree[node_idx].left!=-1)tree[tree[node_idx].left].parent=node_idx;
-  if(tree[node_idx].right!=-1)tree[tree[node_idx].right].parent=node_idx;
+int32_t KDTree::find_nearest(glm::vec3 p) const {
+  Best best = {-1, std::numeric_limits<float>::infinity()};
+  find_nearest_(0, points.size(), p, best);
+  return best.id;
+}
 
-  return node_idx;
+void KDTree::find_nearest(std::span<const glm::vec3> ps, std::span<int32_t> out) const {
+  assert(ps.size() == out.size());
+  #pragma omp parallel for
+  for (size_t i = 0; i < ps.size(); i++) out[i] = find_nearest(ps[i]);
 }
-int32_t KDTree::find_nearest(glm::vec2 p){
-  return find_nearest_(root, p, (find_nn_t){.node=root, .d2=FLT_MAX}, 
-      glm::vec2(-FLT_MAX, -FLT_MAX), glm::vec2(FLT_MAX, FLT_MAX)).node;
+
+// Points on the far side of a split are at least the gap to the split plane
+// away, the gap is compared with <= so equally near points still get seen
+void KDTree::find_nearest_(int32_t lo, int32_t hi, glm::vec3 p, Best& best) const {
+  if (lo >= hi) return;
+  int32_t mid = lo + (hi - lo)/2;
+  float d2 = glm::distance2(p, points[mid]);
+  if (d2 < best.d2 || (d2 == best.d2 && ids[mid] < best.id)) best = {ids[mid], d2};
+  float gap = p[axes[mid]] - points[mid][axes[mid]];
+  if (gap < 0) {
+    find_nearest_(lo, mid, p, best);
+    if (gap*gap <= best.d2) find_nearest_(mid + 1, hi, p, best);
+  } else {
+    find_nearest_(mid + 1, hi, p, best);
+    if (gap*gap <= best.d2) find_nearest_(lo, mid, p, best);
+  }
 }
-float aabb_dist2(glm::vec2 p, glm::vec2 lb, glm::vec2 ub){
-  glm::vec2 h_aabb=(ub-lb)/2.f;
-  glm::vec2 c_aabb=lb+h_aabb;
-  glm::vec2 dp = glm::abs(p-c_aabb)-glm::abs(h_aabb);
-  dp.x = dp.x<0 ? 0 : dp.x;
-  dp.y = dp.y<0 ? 0 : dp.y;
-  return glm::length2(dp);
+
+static bool closer(const auto& a, const auto& b) {
+  return a.d2 < b.d2 || (a.d2 == b.d2 && a.id < b.id);
 }
-KDTree::find_nn_t KDTree::find_nearest_(int node, glm::vec2 p, find_nn_t curr_best, glm::vec2 lb, glm::vec2 ub){
-  if (node==-1) return curr_best;
-  // PRUNE
-  float d_bound = aabb_dist2(p, lb, ub);
-  if (d_bound>curr_best.d2) {
-    return curr_best;
-  }
 
-  // check this node
-  find_nn_t this_res = {.node=node, .d2=glm::length2(p-(*points)[node])};
-  if (curr_best.d2>this_res.d2){ curr_best=this_res; }
+std::vector<int32_t> KDTree::find_k_nearest(glm::vec3 p, size_t k) const {
+  if (k == 0) return {};
+  std::vector<Best> heap;
+  heap.reserve(k);
+  find_k_nearest_(0, points.size(), p, k, heap);
+  std::sort_heap(heap.begin(), heap.end(), [](const Best& a, const Best& b){ return closer(a, b); });
+  std::vector<int32_t> out;
+  out.reserve(heap.size());
+  for (const Best& b : heap) out.push_back(b.id);
+  return out;
+}
 
-  // Get new boundaries
-  glm::vec2 new_lb=lb;
-  glm::vec2 new_ub=ub;
-  if (tree[node].level%2==0){
-    new_lb.x=(*points)[node].x;
-    new_ub.x=(*points)[node].x;
-  }else{
-    new_lb.y=(*points)[node].y;
-    new_ub.y=(*points)[node].y;
+// heap is a max heap on distance holding the k closest so far
+void KDTree::find_k_nearest_(int32_t lo, int32_t hi, glm::vec3 p, size_t k,
+    std::vector<Best>& heap) const {
+  if (lo >= hi) return;
+  auto cmp = [](const Best& a, const Best& b){ return closer(a, b); };
+  int32_t mid = lo + (hi - lo)/2;
+  Best candidate = {ids[mid], glm::distance2(p, points[mid])};
+  if (heap.size() < k) {
+    heap.push_back(candidate);
+    std::push_heap(heap.begin(), heap.end(), cmp);
+  } else if (closer(candidate, heap.front())) {
+    std::pop_heap(heap.begin(), heap.end(), cmp);
+    heap.back() = candidate;
+    std::push_heap(heap.begin(), heap.end(), cmp);
+  }
+  float gap = p[axes[mid]] - points[mid][axes[mid]];
+  if (gap < 0) {
+    find_k_nearest_(lo, mid, p, k, heap);
+    if (heap.size() < k || gap*gap <= heap.front().d2) find_k_nearest_(mid + 1, hi, p, k, heap);
+  } else {
+    find_k_nearest_(mid + 1, hi, p, k, heap);
+    if (heap.size() < k || gap*gap <= heap.front().d2) find_k_nearest_(lo, mid, p, k, heap);
   }
-  // Explore Tree
-  find_nn_t left_best = find_nearest_(tree[node].left, p, curr_best, lb, new_ub);
-  if (curr_best.d2>left_best.d2){ curr_best=left_best; }
-  find_nn_t right_best = find_nearest_(tree[node].right, p, curr_best, new_lb, ub);
-  if (curr_best.d2>right_best.d2){ curr_best=right_best; }
+}
+
+std::vector<int32_t> KDTree::find_radius(glm::vec3 p, float radius) const {
+  std::vector<int32_t> out;
+  find_radius_(0, points.size(), p, radius*radius, out);
+  return out;
+}
 
-  return curr_best;
+void KDTree::find_radius_(int32_t lo, int32_t hi, glm::vec3 p, float r2,
+    std::vector<int32_t>& out) const {
+  if (lo >= hi) return;
+  int32_t mid = lo + (hi - lo)/2;
+  if (glm::distance2(p, points[mid]) <= r2) out.push_back(ids[mid]);
+  float gap = p[axes[mid]] - points[mid][axes[mid]];
+  if (gap <= 0 || gap*gap <= r2) find_radius_(lo, mid, p, r2, out);
+  if (gap >= 0 || gap*gap <= r2) find_radius_(mid + 1, hi, p, r2, out);
 }
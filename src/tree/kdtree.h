@@ -1,23 +1,41 @@
 #pragma once
 
-#include "glm/fwd.hpp"
+#include <cstdint>
+#include <span>
 #include <vector>
-#include "glm/common.hpp"
-#include <memory>
+#include <glm/glm.hpp>
 
+// 3D KD-tree stored as a flat array. The median of the range [lo, hi) sits at
+// (lo+hi)/2 and its children are the ranges on either side, so no child
+// links are kept. Queries return indices into the points it was built from.
+// 2D data can be indexed by leaving one coordinate at zero.
 class KDTree {
 public:
-  std::shared_ptr<std::vector<glm::vec2>> points;
-  int32_t root;
-  struct KDTreeNode {
-    int32_t parent=-1, left=-1, right=-1, level=0;
-  };
-  std::vector<KDTreeNode> tree;
-  KDTree(std::shared_ptr<std::vector<glm::vec2>> p);
+  KDTree(std::span<const glm::vec3> p);
   KDTree() = default;
-  int32_t find_nearest(glm::vec2 p);
+  // -1 if the tree is empty. Ties go to the lowest index
+  int32_t find_nearest(glm::vec3 p) const;
+  // Nearest of each point in ps, written to out
+  void find_nearest(std::span<const glm::vec3> ps, std::span<int32_t> out) const;
+  // Up to k nearest, closest first
+  std::vector<int32_t> find_k_nearest(glm::vec3 p, size_t k) const;
+  // Every point no further than radius, in no particular order
+  std::vector<int32_t> find_radius(glm::vec3 p, float radius) const;
+  size_t size() const { return points.size(); }
 private:
-  int32_t buildKDTree(std::vector<int32_t> &buffer, int32_t start, int32_t end, int32_t level);
-  struct find_nn_t {int node; float d2;};
-  find_nn_t find_nearest_(int node, glm::vec2 p, find_nn_t curr_best, glm::vec2 lb, glm::vec2 ub);
+  // Points and their original indices in tree order
+  std::vector<glm::vec3> points;
+  std::vector<int32_t> ids;
+  // Axis the node at each position splits on
+  std::vector<uint8_t> axes;
+  void build(int32_t lo, int32_t hi);
+  struct Best {
+    int32_t id = -1;
+    float d2;
+  };
+  void find_nearest_(int32_t lo, int32_t hi, glm::vec3 p, Best& best) const;
+  void find_k_nearest_(int32_t lo, int32_t hi, glm::vec3 p, size_t k,
+      std::vector<Best>& heap) const;
+  void find_radius_(int32_t lo, int32_t hi, glm::vec3 p, float r2,
+      std::vector<int32_t>& out) const;
 };
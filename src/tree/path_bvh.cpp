@@ -0,0 +1,69 @@
+#include "tree/path_bvh.h"
+#include "glm/gtx/norm.hpp"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <limits>
+
+PathBVH::PathBVH(std::vector<glm::vec3> p) : points(std::move(p)) {
+  num_leaves = std::bit_ceil(std::max<size_t>(1, (points.size()+leaf_size-1)/leaf_size));
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  // Padding leaves stay empty boxes, they are never closer than anything
+  boxes = std::vector<Box>(2*num_leaves, {glm::vec3(inf), glm::vec3(-inf)});
+  for (size_t i = 0; i < points.size(); i++) {
+    Box& leaf = boxes[num_leaves + i/leaf_size];
+    leaf.min = glm::min(leaf.min, points[i]);
+    leaf.max = glm::max(leaf.max, points[i]);
+  }
+  for (size_t node = num_leaves-1; node >= 1; node--) {
+    boxes[node].min = glm::min(boxes[2*node].min, boxes[2*node+1].min);
+    boxes[node].max = glm::max(boxes[2*node].max, boxes[2*node+1].max);
+  }
+}
+
+// Lower bound on distance2 to any point in the box. Each axis gap is no
+// bigger than the rounded difference to a point inside, so the bound holds
+// in floats too and pruning can't change the answer
+float PathBVH::min_dist2(const Box& box, glm::vec3 pos) const {
+  glm::vec3 d = glm::max(glm::max(box.min - pos, pos - box.max), glm::vec3(0.f));
+  return glm::length2(d);
+}
+
+std::pair<size_t, float> PathBVH::closest(glm::vec3 pos, size_t start, size_t end) const {
+  assert(start <= end && end < points.size());
+  size_t best_index = start;
+  float best_dist2 = glm::distance2(pos, points[start]);
+
+  // Each entry is a node and the half open point range it covers
+  struct Entry { size_t node, lo, hi; };
+  Entry stack[2*std::numeric_limits<size_t>::digits];
+  int top = 0;
+  stack[top++] = {1, 0, num_leaves*leaf_size};
+  while (top > 0) {
+    Entry e = stack[--top];
+    if (e.hi <= start || e.lo > end) continue;
+    if (min_dist2(boxes[e.node], pos) > best_dist2) continue;
+    if (e.node >= num_leaves) {
+      size_t last = std::min({e.hi, end+1, points.size()});
+      for (size_t i = std::max(e.lo, start); i < last; i++) {
+        float dist2 = glm::distance2(pos, points[i]);
+        if (dist2 < best_dist2 || (dist2 == best_dist2 && i < best_index)) {
+          best_dist2 = dist2;
+          best_index = i;
+        }
+      }
+      continue;
+    }
+    // Nearer child goes on top so it is searched first
+    size_t mid = (e.lo + e.hi)/2;
+    Entry left = {2*e.node, e.lo, mid}, right = {2*e.node+1, mid, e.hi};
+    if (min_dist2(boxes[left.node], pos) <= min_dist2(boxes[right.node], pos)) {
+      stack[top++] = right;
+      stack[top++] = left;
+    } else {
+      stack[top++] = left;
+      stack[top++] = right;
+    }
+  }
+  return {best_index, best_dist2};
+}
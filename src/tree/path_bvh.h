@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Bounding boxes over runs of consecutive points, for nearest point queries
+// limited to an index range. Paths stored back to back share one hierarchy,
+// a query on one path just uses that path's range.
+class PathBVH {
+public:
+  PathBVH() = default;
+  explicit PathBVH(std::vector<glm::vec3> points);
+  // Index in [start, end] of the point closest to pos, and its squared
+  // distance. Ties go to the lowest index, same as a linear scan.
+  std::pair<size_t, float> closest(glm::vec3 pos, size_t start, size_t end) const;
+  size_t size() const { return points.size(); }
+private:
+  static constexpr size_t leaf_size = 16;
+  struct Box {
+    glm::vec3 min;
+    glm::vec3 max;
+  };
+  float min_dist2(const Box& box, glm::vec3 pos) const;
+  std::vector<glm::vec3> points;
+  // Complete binary tree rooted at 1, leaf k is boxes[num_leaves+k]
+  std::vector<Box> boxes;
+  size_t num_leaves = 0;
+};
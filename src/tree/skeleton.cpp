@@ -5,23 +5,128 @@
 #include "glm/gtx/vector_angle.hpp"
 #include <glm/gtx/io.hpp>
 #include <iostream>
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <string_view>
+#include <omp.h>
 #include <utility>
 #include <util/geometry.h>
+#include "util/mapped_file.h"
 
 using json = nlohmann::json;
 
-size_t Skeleton::leafs_size() const {return leafs.size();}
-size_t Skeleton::roots_size() const {return root_tips.size();}
+namespace {
+// Backing storage of a parsed skeleton
+struct NodeArrays{
+    std::vector<glm::vec3> positions, tangents, normals, binormals;
+    std::vector<int32_t> parents, child_offsets, children, tips;
+};
+// Backing storage of a binary skeleton, frames are only allocated when the
+// file has none
+struct MappedNodes{
+    MappedFile file;
+    std::vector<glm::vec3> tangents, normals, binormals;
+    explicit MappedNodes(const std::string& filename) : file(filename) {}
+};
+
+// Binary skeleton (.skel), little endian:
+//   SkeletonHeader
+//   positions       float[3*num_nodes]
+//   parents         int32[num_nodes]
+//   child_offsets   int32[num_nodes+1]
+//   children        int32[num_children]
+//   tips            int32[num_tips]
+//   tangents, normals, binormals  float[3*num_nodes] each, if has_frames
+// Stored frames are the ones of a plain forwards load, they are recomputed
+// when loading with an init frame or backwards.
+struct SkeletonHeader{
+    char magic[4];
+    uint32_t version;
+    uint32_t num_nodes;
+    uint32_t num_children;
+    uint32_t num_tips;
+    uint32_t has_frames;
+    uint32_t reserved[2];
+};
+constexpr char skeleton_magic[4] = {'T','S','K','L'};
+constexpr uint32_t skeleton_version = 1;
+static_assert(std::endian::native == std::endian::little,
+              "Binary skeletons are stored little endian");
+static_assert(sizeof(glm::vec3) == 3*sizeof(float));
+
+// Text skeletons are tokenized in pieces, each piece records its points and
+// the order of points and branch brackets so they can be linked up after
+inline bool is_space(char c){
+    return c==' ' || c=='\n' || c=='\r' || c=='\t';
+}
+struct TextPiece{
+    std::vector<glm::vec3> points;
+    std::string ops; // '(' point, '[' branch start, ']' branch end
+};
+float parse_coordinate(std::string_view token){
+    if (!token.empty() && token[0]=='+') token.remove_prefix(1);
+    float value;
+    auto [end, ec] = std::from_chars(token.data(), token.data()+token.size(), value);
+    if (ec != std::errc())
+        throw std::invalid_argument( "Incorrect file format: could not read position \"" + std::string(token) + "\"" );
+    return value;
+}
+void tokenize(std::string_view text, TextPiece& piece){
+    size_t pos = 0;
+    auto next = [&text, &pos]() -> std::string_view {
+        while (pos < text.size() && is_space(text[pos])) pos++;
+        size_t start = pos;
+        while (pos < text.size() && !is_space(text[pos])) pos++;
+        return text.substr(start, pos-start);
+    };
+    for (std::string_view token = next(); !token.empty(); token = next()){
+        if (token.find('[')!=std::string_view::npos) piece.ops.push_back('[');
+        if (token.find(']')!=std::string_view::npos) piece.ops.push_back(']');
+        if (token.find('(')!=std::string_view::npos){
+            glm::vec3 position;
+            position.x = parse_coordinate(next());
+            position.z = parse_coordinate(next());
+            position.y = parse_coordinate(next());
+            if (next().find(')')==std::string_view::npos)
+                throw std::invalid_argument( "Incorrect file format: position parentheses not closed" );
+            piece.points.push_back(position);
+            piece.ops.push_back('(');
+        }
+    }
+}
+}
+
+size_t Skeleton::leafs_size() const {return shoot_nodes.tips.size();}
+size_t Skeleton::roots_size() const {return root_nodes.tips.size();}
 std::pair<glm::vec3,glm::vec3> Skeleton::get_bounds() const {return bounds;}
 glm::vec3 Skeleton::get_com() const {return center_of_mass;}
-glm::vec3 Skeleton::get_root_pos() const {return frame_position(shoot_root->frame);}
-glm::mat4 Skeleton::get_root_frame() const {return shoot_root->frame;}
+glm::vec3 Skeleton::get_root_pos() const {return shoot_nodes.positions[0];}
+glm::mat4 Skeleton::get_root_frame() const {return shoot_nodes.frame(0);}
 float Skeleton::get_average_length() const {return average_length;}
 
 
 Skeleton::Skeleton(json& options){
-    shoot_stats = parse(shoot_root, leafs, std::string(options["path"])+std::string(options["tree_file"]));
-    root_stats = parse(root_root, root_tips, std::string(options["path"])+std::string(options["root_file"]),shoot_root->frame,BACKWARDS);
+    std::string shoot_file = std::string(options["path"])+std::string(options["tree_file"]);
+    std::string root_file = std::string(options["path"])+std::string(options["root_file"]);
+    auto parse_start = std::chrono::steady_clock::now();
+    // The trees only depend on each other through the root's init frame
+    auto root_read = std::async(std::launch::async, [&root_file]{
+        bool has_frames;
+        return read(root_file, has_frames);
+    });
+    shoot_nodes = load(shoot_file);
+    root_nodes = root_read.get();
+    compute_frames(root_nodes, get_root_frame(), BACKWARDS);
+    parse_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-parse_start).count();
+    parsed_bytes = std::filesystem::file_size(shoot_file)+std::filesystem::file_size(root_file);
 
     root_zup = options.contains("root_zup") ? (bool)options.at("root_zup") : true;
     shoot_zup = options.contains("shoot_zup") ? (bool)options.at("shoot_zup") : true;
@@ -33,13 +138,16 @@ Skeleton::Skeleton(json& options){
     //
 
     std::cout<<"---- Skeleton Stats ----"<<std::endl;
-    std::cout<<"Root Position: "<<frame_position(shoot_root->frame)<<std::endl;
+    std::cout<<"Root Position: "<<get_root_pos()<<std::endl;
     std::cout<<"Number of Leafs: "<< leafs_size()<<std::endl;
     std::cout<<"Number of Roots: "<< roots_size()<<std::endl;
+    std::cout<<"Number of Nodes: "<< shoot_nodes.size()+root_nodes.size()<<std::endl;
     std::cout<<"Average Shoot Segment Length: "<< average_shoot_length<<std::endl;
     std::cout<<"Average Root Segment Length: "<< average_root_length<<std::endl;
     std::cout<<"Average Segment Length: "<< average_length<<std::endl;
     std::cout<<"Max Extent: "<<bounds.first<<" "<<bounds.second<<std::endl;
+    std::cout<<"Parse Throughput: "<<parsed_bytes/parse_seconds/1e6<<" MB/s ("
+             <<parsed_bytes/1e6<<" MB in "<<parse_seconds*1e3<<" ms)"<<std::endl;
     std::cout<<"------------------------"<<std::endl;
 }
 
@@ -58,67 +166,18 @@ Mesh<VertFlat> Skeleton::get_mesh_frames(){
     };
     std::vector<VertFlat> vertices;
     std::vector<GLuint> indices;
-    struct Info{
-        std::shared_ptr<Node> node;
-        GLuint index;   // Index of the node's end point
-        GLuint parent_index=0;   // Index of the node's end point
-        unsigned int children_explored = 0;
-    };
-    Info last_node{shoot_root, 0};
-    std::stack<Info> last_split;
-    bool done = false;
-    bool done_shoot = false;
-    int debug_counter=0;
-    while (!done){
-        unsigned int num_children = last_node.node->children.size();
-        unsigned int explored = last_node.children_explored;
-        // Add node to vertices (first time node is reached)
-        if (explored==0){
-            if (!done_shoot){
-                //std::cout<<frame_position(last_node.node->frame)<<std::endl;
-            }
+    vertices.reserve(6*(shoot_nodes.size()+root_nodes.size()));
+    indices.reserve(6*(shoot_nodes.size()+root_nodes.size()));
+    for (const Nodes* nodes : {&shoot_nodes, &root_nodes}){
+        for (int32_t i = 0; i < nodes->size(); i++){
+            glm::mat4 frame = nodes->frame(i);
             for (auto vert : axis){
                 VertFlat v=vert;
-                v.position = glm::vec3(last_node.node->frame*glm::vec4(v.position,1.f));
+                v.position = glm::vec3(frame*glm::vec4(v.position,1.f));
                 vertices.push_back(v);
                 indices.push_back(vertices.size()-1);
             }
         }
-
-        // See how to continue
-        if(num_children==0){
-            // Reached leaf go back to last split
-            if ( last_split.empty() ) {
-                done = true;
-            }
-            else {
-                last_split.top().children_explored++;
-                last_node=last_split.top();
-            }
-        } else if(num_children==1){
-            // Straight path
-            last_node = {last_node.node->children[0],(GLuint)vertices.size(), last_node.index};
-        }else{
-            if (explored<num_children){
-                // Children left to explore
-                if (last_split.empty() || last_split.top().index!=last_node.index){
-                    last_split.push(last_node);
-                }
-                last_node = {last_node.node->children[last_node.children_explored],(GLuint)vertices.size(), last_node.index};
-            }else{
-                // Children all explored
-                if(!last_split.empty()) last_split.pop();
-                if(!last_split.empty()){
-                    last_split.top().children_explored++;
-                    last_node = last_split.top();
-                }else done = true;
-            }
-        }
-        if (done && !done_shoot){
-          done_shoot = true;
-          done = false;
-          last_node = {root_root, 0};
-        }
     }
     return Mesh(vertices, indices); 
 }
@@ -128,61 +187,17 @@ Mesh<VertFlat> Skeleton::get_mesh_lines(){
     // Initialize mesh verts and indices
     std::vector<VertFlat> vertices;
     std::vector<GLuint> indices;
-    struct Info{
-        std::shared_ptr<Node> node;
-        GLuint index;   // Index of the node's end point
-        GLuint parent_index=0;   // Index of the node's end point
-        unsigned int children_explored = 0;
-    };
-    Info last_node{shoot_root, 0};
-    std::stack<Info> last_split;
-    bool done = false;
-    bool done_shoot = false;
-    int debug_counter=0;
-    while (!done){
-        unsigned int num_children = last_node.node->children.size();
-        unsigned int explored = last_node.children_explored;
-        // Add node to vertices (first time node is reached)
-        if (explored==0){
-            vertices.push_back(VertFlat{frame_position(last_node.node->frame),random_color()});
-            //vertices.push_back(VertFlat{frame_position(last_node.node->frame),glm::vec3(0,0,0)});
-            indices.push_back(last_node.parent_index);
-            indices.push_back(last_node.index);
-        }
-
-        // See how to continue
-        if(num_children==0){
-            // Reached leaf go back to last split
-            if ( last_split.empty() ) {
-                done = true;
-            }
-            else {
-                last_split.top().children_explored++;
-                last_node=last_split.top();
-            }
-        } else if(num_children==1){
-            // Straight path
-            last_node = {last_node.node->children[0],(GLuint)vertices.size(), last_node.index};
-        }else{
-            if (explored<num_children){
-                // Children left to explore
-                if (last_split.empty() || last_split.top().index!=last_node.index){
-                    last_split.push(last_node);
-                }
-                last_node = {last_node.node->children[last_node.children_explored],(GLuint)vertices.size(), last_node.index};
-            }else{
-                // Children all explored
-                if(!last_split.empty()) last_split.pop();
-                if(!last_split.empty()){
-                    last_split.top().children_explored++;
-                    last_node = last_split.top();
-                }else done = true;
-            }
-        }
-        if (done && !done_shoot){
-          done_shoot = true;
-          done = false;
-          last_node = {root_root, 0};
+    vertices.reserve(shoot_nodes.size()+root_nodes.size());
+    indices.reserve(2*(shoot_nodes.size()+root_nodes.size()));
+    for (const Nodes* nodes : {&shoot_nodes, &root_nodes}){
+        // Both trees hang off the shoot base, which is vertex 0
+        GLuint base = vertices.size();
+        auto vertex_index = [base](int32_t i) -> GLuint { return i==0 ? 0 : base+i; };
+        for (int32_t i = 0; i < nodes->size(); i++){
+            vertices.push_back(VertFlat{nodes->positions[i],random_color()});
+            int32_t parent = nodes->parents[i];
+            indices.push_back(parent < 0 ? 0 : vertex_index(parent));
+            indices.push_back(vertex_index(i));
         }
     }
     return Mesh(vertices, indices);
@@ -190,66 +205,60 @@ Mesh<VertFlat> Skeleton::get_mesh_lines(){
 
 std::vector<glm::mat4> Skeleton::get_strand(size_t index, path_type type) const
 {
-    auto &paths = type == LEAF ? leafs : root_tips;
-    if ( index >= paths.size() || index < 0) {
+    const Nodes& nodes = type == LEAF ? shoot_nodes : root_nodes;
+    if ( index >= nodes.tips.size() || index < 0) {
         std::cout<<"Not a valid strand"<<std::endl;
         return std::vector<glm::mat4>();
     }
     std::vector<glm::mat4> strand;
-    std::shared_ptr<Node> current = paths[index];
-    while ( current != nullptr){
-        strand.push_back(current->frame);
-        current = current->parent;
+    for (int32_t current = nodes.tips[index]; current >= 0; current = nodes.parents[current]){
+        strand.push_back(nodes.frame(current));
     }
     return strand;
 }
 
-void Skeleton::transform_dfs(Node& node, glm::mat4 t, glm::mat4 s, glm::mat4 r){
-    //node.frame = r*s*glm::translate(glm::vec3(t*glm::vec4(frame_position(node.frame),1.f)));
-    glm::vec4 p = glm::vec4(frame_position(s*glm::translate(glm::vec3(t*glm::vec4(frame_position(node.frame),1.f)))),1.f);
-    node.frame[3]=p;
-    for (int i = 0; i<node.children.size();i++){
-        transform_dfs(*node.children[i],t,s,r);
+void Skeleton::get_path(size_t index, path_type type, std::vector<int32_t>& out) const
+{
+    const Nodes& nodes = get_nodes(type);
+    if ( index >= nodes.tips.size()) {
+        std::cout<<"Not a valid strand"<<std::endl;
+        return;
+    }
+    for (int32_t current = nodes.tips[index]; current >= 0; current = nodes.parents[current]){
+        out.push_back(current);
+    }
+}
+
+void Skeleton::transform_nodes(Nodes& nodes, glm::mat4 t, glm::mat4 s, glm::mat4 r){
+    for (auto& position : nodes.positions){
+        position = glm::vec3(s*glm::vec4(glm::vec3(t*glm::vec4(position,1.f)),1.f));
     }
 }
 
 void Skeleton::transform(){
-    glm::mat4 shoot_t = glm::translate(-frame_position(shoot_root->frame));
+    glm::mat4 shoot_t = glm::translate(-shoot_nodes.positions[0]);
     float shoot_scale_amount = 0.0055f/(shoot_stats.total_length/shoot_stats.num_nodes);
     glm::mat4 shoot_s = glm::scale(glm::vec3(shoot_scale_amount,shoot_scale_amount,shoot_scale_amount));
     glm::mat4 shoot_r = shoot_zup ? 
         glm::mat4(1.f) : 
         glm::rotate(glm::mat4(1.f), (float)-M_PI/2.f, glm::vec3(1,0,0));
 
-    glm::mat4 root_t = glm::translate(-frame_position(root_root->frame));
+    glm::mat4 root_t = glm::translate(-root_nodes.positions[0]);
     float root_scale_amount = 0.0055f/(root_stats.total_length/root_stats.num_nodes);
     glm::mat4 root_s = glm::scale(glm::vec3(root_scale_amount,root_scale_amount,root_scale_amount));
     glm::mat4 root_r = root_zup ? 
         glm::mat4(1.f) : 
         glm::rotate(glm::mat4(1.f), (float)-M_PI/2.f, glm::vec3(1,0,0));
 
-    std::cout<<frame_position(shoot_root->frame)<<std::endl;
-    std::cout<<frame_position(root_root->frame)<<std::endl;
-    transform_dfs(*shoot_root, shoot_t, shoot_s, shoot_r);
-    transform_dfs(*root_root, root_t, root_s, root_r);
+    std::cout<<shoot_nodes.positions[0]<<std::endl;
+    std::cout<<root_nodes.positions[0]<<std::endl;
+    transform_nodes(shoot_nodes, shoot_t, shoot_s, shoot_r);
+    transform_nodes(root_nodes, root_t, root_s, root_r);
 }
 
 void Skeleton::calculate_stats(){
-    //Root stats calc
-    root_stats.num_nodes=0;
-    root_stats.total_length=0.f;
-    root_stats.center_of_mass = glm::vec3();
-    root_stats.extent = std::make_pair(glm::vec3(), glm::vec3()),
-    stats_dfs(*root_root,root_stats);
-    root_stats.center_of_mass *= (1.f/root_stats.num_nodes);
-
-    //Root stats calc
-    shoot_stats.num_nodes=0;
-    shoot_stats.total_length=0.f;
-    shoot_stats.center_of_mass = glm::vec3();
-    shoot_stats.extent = std::make_pair(glm::vec3(), glm::vec3()),
-    stats_dfs(*shoot_root,shoot_stats);
-    shoot_stats.center_of_mass *= (1.f/shoot_stats.num_nodes);
+    root_stats = node_stats(root_nodes);
+    shoot_stats = node_stats(shoot_nodes);
 
     center_of_mass = shoot_stats.center_of_mass;
     average_length = (shoot_stats.total_length+root_stats.total_length)/(shoot_stats.num_nodes+root_stats.num_nodes);
@@ -260,162 +269,305 @@ void Skeleton::calculate_stats(){
     bounds.second.y = fmax(shoot_stats.extent.second.y,root_stats.extent.second.y);
     bounds.second.z = fmax(shoot_stats.extent.second.z,root_stats.extent.second.z);
 }
-void Skeleton::stats_dfs(Node& node, ParseInfo& stats){
-    glm::vec3 position = frame_position(node.frame);
-    stats.extent.first.x = fmin(stats.extent.first.x,position.x);
-    stats.extent.first.y = fmin(stats.extent.first.y,position.y);
-    stats.extent.first.z = fmin(stats.extent.first.z,position.z);
-    stats.extent.second.x = fmax(stats.extent.second.x,position.x);
-    stats.extent.second.y = fmax(stats.extent.second.y,position.y);
-    stats.extent.second.z = fmax(stats.extent.second.z,position.z);
-    stats.center_of_mass += position;
-    stats.num_nodes++;
-    for (int i = 0; i<node.children.size();i++){
-        Node& child = *node.children[i];
-        float dist = glm::length(frame_position(child.frame)-frame_position(node.frame));
-        stats.total_length+=dist;
-        stats_dfs(child, stats);
+Skeleton::ParseInfo Skeleton::node_stats(const Nodes& nodes){
+    ParseInfo stats = {
+            .extent = std::make_pair(glm::vec3(), glm::vec3()),
+            .center_of_mass = glm::vec3(),
+            .num_nodes = (int)nodes.size(),
+            .total_length = 0.f
+    };
+    // Parse order is depth first, so this matches a recursive walk
+    for (int32_t i = 0; i < nodes.size(); i++){
+        glm::vec3 position = nodes.positions[i];
+        stats.extent.first.x = fmin(stats.extent.first.x,position.x);
+        stats.extent.first.y = fmin(stats.extent.first.y,position.y);
+        stats.extent.first.z = fmin(stats.extent.first.z,position.z);
+        stats.extent.second.x = fmax(stats.extent.second.x,position.x);
+        stats.extent.second.y = fmax(stats.extent.second.y,position.y);
+        stats.extent.second.z = fmax(stats.extent.second.z,position.z);
+        stats.center_of_mass += position;
+        if (nodes.parents[i] >= 0)
+            stats.total_length += glm::length(position-nodes.positions[nodes.parents[i]]);
     }
+    stats.center_of_mass *= (1.f/stats.num_nodes);
+    return stats;
 }
 
-Skeleton::ParseInfo Skeleton::parse(std::shared_ptr<Node>& root,
-                                  std::vector<std::shared_ptr<Node>>& leafs,
-                                  std::string filename, 
-                                  glm::mat4 init_frame,
-                                  Direction dir) {
-    // Initialize file stream, and string token
-    std::ifstream in(filename);
-    std::string token;
-
-    #define GET_NEXT(token) std::getline(in,token, ' ')
-    #define PARSE_POINT(token, pos)     \
-        GET_NEXT(token);                \
-        pos.x = std::stof(token);       \
-        GET_NEXT(token);                \
-        pos.z = std::stof(token);       \
-        GET_NEXT(token);                \
-        pos.y = std::stof(token);       \
-        GET_NEXT(token);                \
-        if(token.find(")")==std::string::npos)    \
-            throw std::invalid_argument( "Incorrect file format: position parentheses not closed" )    \
-    
-    // Initialize root node
-    root = std::make_shared<Skeleton::Node>(Skeleton::Node{});
-    // Get root start
-    GET_NEXT(token);
-    if (token.find("(")==std::string::npos)
-        throw std::invalid_argument( "Incorrect file format: Opening parentheses for position not found" );
-    glm::vec3 position;
-    PARSE_POINT(token, position);
-    root->frame = glm::translate(position);
+Skeleton::Nodes Skeleton::load(const std::string& filename,
+                               glm::mat4 init_frame,
+                               Direction dir) {
+    bool has_frames;
+    Nodes nodes = read(filename, has_frames);
+    // Stored frames are overwritten in the private mapping if they don't apply
+    if (!has_frames || init_frame != glm::mat4(0.f) || dir != FORWARDS)
+        compute_frames(nodes, init_frame, dir);
+    return nodes;
+}
 
-    std::stack<std::shared_ptr<Skeleton::Node>> last_split;
-    last_split.push(root);
-    std::shared_ptr<Skeleton::Node> last_node=root;
+Skeleton::Nodes Skeleton::read(const std::string& filename, bool& has_frames) {
+    if (filename.ends_with(".skel"))
+        return load_binary(filename, has_frames);
+    has_frames = false;
+    return parse(filename);
+}
 
-    // Setting up stats
-    ParseInfo stats = {
-            .extent = std::make_pair(frame_position(root->frame), frame_position(root->frame)),
-            .center_of_mass = frame_position(root->frame),
-            .num_nodes = 1,
-            .total_length = 0
-    };
-    bool after_root = true;
-    for (std::string token; GET_NEXT(token);) 
-    {
-        // Branch starting
-        if(token.find("[")!=std::string::npos){
-            last_split.push(last_node);
+void Skeleton::compute_frames(Nodes& nodes, glm::mat4 init_frame, Direction dir){
+    if (nodes.size() == 0) return;
+    nodes.normals[0] = glm::vec3(1,0,0);
+    nodes.tangents[0] = glm::vec3(0,1,0);
+    nodes.binormals[0] = glm::vec3(0,0,1);
+    if (nodes.size() == 1) return;
+    // Base frame
+    if (init_frame != glm::mat4(0.f)){
+        nodes.normals[0] = init_frame[0];
+        nodes.tangents[0] = init_frame[1];
+        nodes.binormals[0] = init_frame[2];
+        nodes.positions[0] = init_frame[3];
+    } else { // Calculate Frame
+        // Get prev and this tangent
+        glm::vec3 tangent = glm::normalize(dir == FORWARDS ? 
+            nodes.positions[1]-nodes.positions[0] : 
+            nodes.positions[0]-nodes.positions[1]);
+        // Transform N and B to new frame
+        glm::vec3 normal = glm::vec3(1,0,0);
+        glm::vec3 binormal = glm::cross(tangent,normal);
+        normal = glm::cross(tangent,binormal);
+        // Update new frame
+        nodes.normals[0] = normal;
+        nodes.tangents[0] = tangent;
+        nodes.binormals[0] = binormal;
+    }
+    // Parents come before their children, so one pass propagates the frames
+    for (int32_t i = 1; i < nodes.size(); i++){
+        int32_t parent = nodes.parents[i];
+        glm::vec3 position = nodes.positions[i];
+        // Get prev and this tangent
+        glm::vec3 tangent = glm::normalize(dir == FORWARDS ? 
+            position-nodes.positions[parent] : 
+            nodes.positions[parent]-position);
+        glm::vec3 last_tangent = nodes.tangents[parent];
+        // Get rotation to new frame
+        glm::vec3 rot_axis = glm::cross(last_tangent,tangent);
+        float angle = glm::angle(last_tangent,tangent);
+        glm::mat4 rotation = glm::rotate(glm::mat4(1.f),angle,rot_axis);
+        if (rot_axis==glm::vec3(0,0,0)){
+           rotation=glm::mat4(1.f); 
         }
-        // Branch ending
-        if(token.find("]")!=std::string::npos){
-            // Save onto fringe list
-            leafs.push_back(last_node); 
-            // Go back to the branch split point
-            last_node = last_split.top();
-            last_split.pop();
+        // Transform N and B to new frame
+        nodes.normals[i] = rotation*glm::vec4(nodes.normals[parent],0);
+        nodes.tangents[i] = tangent;
+        nodes.binormals[i] = rotation*glm::vec4(nodes.binormals[parent],0);
+    }
+}
+
+Skeleton::Nodes Skeleton::parse(const std::string& filename) {
+    // Read the whole file into one buffer
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        throw std::runtime_error( "Could not open " + filename );
+    std::string text(std::filesystem::file_size(filename), '\0');
+    in.read(text.data(), text.size());
+    in.close();
+
+    // Split into pieces that each start on a point, and tokenize them in
+    // parallel. Numbers are the expensive part, linking nodes up is cheap.
+    const size_t min_piece = 1<<16;
+    size_t num_pieces = std::clamp(text.size()/min_piece, (size_t)1, (size_t)omp_get_max_threads()*4);
+    std::vector<size_t> bounds(num_pieces+1, text.size());
+    bounds[0] = 0;
+    for (size_t i = 1; i < num_pieces; i++){
+        size_t pos = std::max(bounds[i-1], i*text.size()/num_pieces);
+        while (pos < text.size() && !(text[pos]=='(' && is_space(text[pos-1]))) pos++;
+        bounds[i] = pos;
+    }
+    std::vector<TextPiece> pieces(num_pieces);
+    std::exception_ptr error;
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < num_pieces; i++){
+        try {
+            tokenize(std::string_view(text).substr(bounds[i], bounds[i+1]-bounds[i]), pieces[i]);
+        } catch (...) {
+            #pragma omp critical
+            error = std::current_exception();
         }
+    }
+    if (error) std::rethrow_exception(error);
 
-        // Point being specified
-        if(token.find("(")!=std::string::npos){
-            // Define position of the node  
-            PARSE_POINT(token,position);
-            std::shared_ptr<Node>next=
-                std::make_shared<Node>(Node{
-                        .frame = glm::translate(position),
-                        .parent = last_node,
-                        .children = {}
-                        });
-
-            // Define node's relationship
-            next->parent = last_node;
-            last_node->children.push_back(next);
-            // Update Frame
-            if (after_root) {
-                after_root = false;
-                if (init_frame != glm::mat4(0.f)){
-                    last_node->frame = init_frame; 
-                } else { // Calculate Frame
-                    // Get prev and this tangent
-                    glm::vec3 tangent = glm::normalize(dir == FORWARDS ? 
-                        position-frame_position(next->parent->frame) : 
-                        frame_position(next->parent->frame)-position);
-                    // Transform N and B to new frame
-                    glm::vec3 normal = glm::vec3(1,0,0);
-                    glm::vec3 binormal = glm::cross(tangent,normal);
-                    normal = glm::cross(tangent,binormal);
-                    // Update new frame
-                    last_node->frame = last_node->frame*glm::mat4(
-                            glm::vec4(normal,0),
-                            glm::vec4(tangent,0),
-                            glm::vec4(binormal,0),
-                            glm::vec4(0,0,0,1));
-                }
-            }
-            // Get prev and this tangent
-            glm::vec3 tangent = glm::normalize(dir == FORWARDS ? 
-                position-frame_position(next->parent->frame) : 
-                frame_position(next->parent->frame)-position);
-            glm::vec3 last_tangent = next->parent->frame*glm::vec4(0,1,0,0);
-            // Get rotation to new frame
-            glm::vec3 rot_axis = glm::cross(last_tangent,tangent);
-            float angle = glm::angle(last_tangent,tangent);
-            glm::mat4 rotation = glm::rotate(glm::mat4(1.f),angle,rot_axis);
-            if (rot_axis==glm::vec3(0,0,0)){
-               rotation=glm::mat4(1.f); 
+    // Link points up into a tree
+    auto arrays = std::make_shared<NodeArrays>();
+    size_t total_points = 0;
+    for (const auto& piece : pieces) total_points += piece.points.size();
+    arrays->positions.reserve(total_points);
+    arrays->parents.reserve(total_points);
+    for (const auto& piece : pieces)
+        arrays->positions.insert(arrays->positions.end(), piece.points.begin(), piece.points.end());
+    if (pieces[0].ops.empty() || pieces[0].ops[0] != '(')
+        throw std::invalid_argument( "Incorrect file format: Opening parentheses for position not found" );
+
+    std::stack<int32_t> last_split;
+    int32_t last_node=-1;
+    for (const auto& piece : pieces){
+        for (char op : piece.ops){
+            switch (op){
+                case '(':
+                    // Define node's relationship
+                    arrays->parents.push_back(last_node);
+                    // Update last node
+                    last_node = arrays->parents.size()-1;
+                    // Root is the first split point
+                    if (last_node == 0) last_split.push(0);
+                    break;
+                case '[':
+                    // Branch starting
+                    last_split.push(last_node);
+                    break;
+                case ']':
+                    if (last_split.empty())
+                        throw std::invalid_argument( "Incorrect file format: unbalanced branch brackets" );
+                    // Save onto fringe list
+                    arrays->tips.push_back(last_node);
+                    // Go back to the branch split point
+                    last_node = last_split.top();
+                    last_split.pop();
+                    break;
             }
-            // Transform N and B to new frame
-            glm::vec3 normal = rotation*next->parent->frame*glm::vec4(1,0,0,0);
-            glm::vec3 binormal = rotation*next->parent->frame*glm::vec4(0,0,1,0);
-            // Update new frame
-            next->frame = next->frame*glm::mat4(
-                    glm::vec4(normal,0),
-                    glm::vec4(tangent,0),
-                    glm::vec4(binormal,0),
-                    glm::vec4(0,0,0,1));
-
-            // Update last node
-            last_node=next;
-
-            // Updates for stats
-            // Bounds
-            stats.extent.first.x = fmin(stats.extent.first.x,position.x);
-            stats.extent.first.y = fmin(stats.extent.first.y,position.y);
-            stats.extent.first.z = fmin(stats.extent.first.z,position.z);
-            stats.extent.second.x = fmax(stats.extent.second.x,position.x);
-            stats.extent.second.y = fmax(stats.extent.second.y,position.y);
-            stats.extent.second.z = fmax(stats.extent.second.z,position.z);
-            // COM
-            stats.center_of_mass += position;
-            // length
-            //std::cout<<glm::distance(position,frame_position(next->parent->frame))<<std::endl;
-            stats.total_length += glm::distance(position, frame_position(next->parent->frame));
-            stats.num_nodes++;
         }
     }
-    //std::cout<<std::endl;
-    leafs.push_back(last_node);
-    in.close();
-    stats.center_of_mass *= (1.f/stats.num_nodes);
-    return stats;
+    arrays->tips.push_back(last_node);
+
+    size_t num_nodes = arrays->positions.size();
+    // Counting sort on parent index keeps children in file order
+    arrays->child_offsets.assign(num_nodes+1, 0);
+    for (int32_t parent : arrays->parents)
+        if (parent >= 0) arrays->child_offsets[parent+1]++;
+    for (size_t i = 0; i < num_nodes; i++)
+        arrays->child_offsets[i+1] += arrays->child_offsets[i];
+    arrays->children.resize(arrays->child_offsets.back());
+    std::vector<int32_t> fill(arrays->child_offsets.begin(), arrays->child_offsets.end()-1);
+    for (int32_t i = 0; i < num_nodes; i++)
+        if (arrays->parents[i] >= 0) arrays->children[fill[arrays->parents[i]]++] = i;
+    // Frames are filled in by compute_frames
+    arrays->tangents.resize(num_nodes);
+    arrays->normals.resize(num_nodes);
+    arrays->binormals.resize(num_nodes);
+
+    Nodes nodes;
+    nodes.positions = arrays->positions;
+    nodes.tangents = arrays->tangents;
+    nodes.normals = arrays->normals;
+    nodes.binormals = arrays->binormals;
+    nodes.parents = arrays->parents;
+    nodes.child_offsets = arrays->child_offsets;
+    nodes.children = arrays->children;
+    nodes.tips = arrays->tips;
+    nodes.storage = arrays;
+    return nodes;
+}
+
+Skeleton::Nodes Skeleton::load_binary(const std::string& filename,
+                                      bool& has_frames) {
+    auto mapped = std::make_shared<MappedNodes>(filename);
+    std::byte* data = mapped->file.data();
+    size_t file_size = mapped->file.size();
+
+    SkeletonHeader header;
+    if (file_size < sizeof(header))
+        throw std::invalid_argument( "Incorrect file format: binary skeleton header truncated" );
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, skeleton_magic, sizeof(skeleton_magic)) != 0)
+        throw std::invalid_argument( "Incorrect file format: not a binary skeleton" );
+    if (header.version != skeleton_version)
+        throw std::invalid_argument( "Incorrect file format: unsupported binary skeleton version" );
+    size_t num_nodes = header.num_nodes;
+    // Indices are stored as int32
+    if (num_nodes == 0 || header.num_nodes > INT32_MAX ||
+        header.num_children > INT32_MAX || header.num_tips > INT32_MAX)
+        throw std::invalid_argument( "Incorrect file format: binary skeleton counts out of range" );
+    // The counts are 32 bit, so this stays far below 2^64
+    uint64_t expected_size = sizeof(header) +
+        sizeof(float)*3*(uint64_t)header.num_nodes*(header.has_frames ? 4 : 1) +
+        sizeof(int32_t)*(2*(uint64_t)header.num_nodes+1+header.num_children+header.num_tips);
+    if ((uint64_t)file_size != expected_size)
+        throw std::invalid_argument( "Incorrect file format: binary skeleton size does not match header" );
+
+    // Arrays are used in place, straight out of the mapping
+    std::byte* cursor = data + sizeof(header);
+    auto take_vec3 = [&cursor](size_t count){
+        std::span<glm::vec3> section(reinterpret_cast<glm::vec3*>(cursor), count);
+        cursor += count*sizeof(glm::vec3);
+        return section;
+    };
+    auto take_int = [&cursor](size_t count){
+        std::span<int32_t> section(reinterpret_cast<int32_t*>(cursor), count);
+        cursor += count*sizeof(int32_t);
+        return section;
+    };
+    Nodes nodes;
+    nodes.positions = take_vec3(num_nodes);
+    nodes.parents = take_int(num_nodes);
+    nodes.child_offsets = take_int(num_nodes+1);
+    nodes.children = take_int(header.num_children);
+    nodes.tips = take_int(header.num_tips);
+    // Everything below indexes with these, so a bad file must not get past
+    if (nodes.parents[0] != -1)
+        throw std::invalid_argument( "Incorrect file format: binary skeleton root has a parent" );
+    for (size_t i = 1; i < num_nodes; i++){
+        if (nodes.parents[i] < 0 || nodes.parents[i] >= (int32_t)i)
+            throw std::invalid_argument( "Incorrect file format: binary skeleton parent out of order" );
+    }
+    if (nodes.child_offsets[0] != 0 || nodes.child_offsets.back() != (int32_t)header.num_children)
+        throw std::invalid_argument( "Incorrect file format: binary skeleton child lists are corrupt" );
+    for (size_t i = 0; i < num_nodes; i++){
+        if (nodes.child_offsets[i] > nodes.child_offsets[i+1])
+            throw std::invalid_argument( "Incorrect file format: binary skeleton child lists are corrupt" );
+    }
+    auto in_range = [num_nodes](int32_t node){ return node >= 0 && (size_t)node < num_nodes; };
+    if (!std::all_of(nodes.children.begin(), nodes.children.end(), in_range) ||
+        !std::all_of(nodes.tips.begin(), nodes.tips.end(), in_range))
+        throw std::invalid_argument( "Incorrect file format: binary skeleton node index out of range" );
+    if (header.has_frames){
+        nodes.tangents = take_vec3(num_nodes);
+        nodes.normals = take_vec3(num_nodes);
+        nodes.binormals = take_vec3(num_nodes);
+    } else {
+        mapped->tangents.resize(num_nodes);
+        mapped->normals.resize(num_nodes);
+        mapped->binormals.resize(num_nodes);
+        nodes.tangents = mapped->tangents;
+        nodes.normals = mapped->normals;
+        nodes.binormals = mapped->binormals;
+    }
+    nodes.storage = mapped;
+    has_frames = header.has_frames;
+    return nodes;
+}
+
+void Skeleton::save_binary(const Nodes& nodes, const std::string& filename,
+                           bool with_frames) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        throw std::runtime_error( "Could not open " + filename + " for writing" );
+    SkeletonHeader header = {};
+    std::memcpy(header.magic, skeleton_magic, sizeof(skeleton_magic));
+    header.version = skeleton_version;
+    header.num_nodes = nodes.size();
+    header.num_children = nodes.children.size();
+    header.num_tips = nodes.tips.size();
+    header.has_frames = with_frames;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    auto write = [&out](auto section){
+        out.write(reinterpret_cast<const char*>(section.data()), section.size_bytes());
+    };
+    write(nodes.positions);
+    write(nodes.parents);
+    write(nodes.child_offsets);
+    write(nodes.children);
+    write(nodes.tips);
+    if (with_frames){
+        write(nodes.tangents);
+        write(nodes.normals);
+        write(nodes.binormals);
+    }
+    if (!out)
+        throw std::runtime_error( "Could not write " + filename );
 }
@@ -3,6 +3,8 @@
 #include <vector>
 #include <stack>
 #include <array>
+#include <span>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <fstream>
@@ -38,15 +40,55 @@ class Skeleton{
         };
         std::vector<glm::mat4> get_strand(size_t index, path_type type=LEAF) const;
 
-        struct Node{
-            glm::mat4 frame;
-            std::shared_ptr<Node> parent;
-            std::vector<std::shared_ptr<Node>>children;
-        }; 
-        std::shared_ptr<Node> shoot_root;
-        std::vector<std::shared_ptr<Node>> leafs;
-        std::shared_ptr<Node> root_root;
-        std::vector<std::shared_ptr<Node>> root_tips;
+        // Flat skeleton, nodes are stored in parse (depth first) order so a
+        // node's parent always has a lower index. Node 0 is the base.
+        // The arrays point into storage, which is either parsed text or a
+        // mapped binary skeleton file.
+        struct Nodes{
+            std::span<glm::vec3> positions;
+            std::span<glm::vec3> tangents;
+            std::span<glm::vec3> normals;
+            std::span<glm::vec3> binormals;
+            std::span<int32_t> parents;       // -1 for the base
+            std::span<int32_t> child_offsets; // CSR, size()+1 entries
+            std::span<int32_t> children;
+            std::span<int32_t> tips;          // Ends of paths, in file order
+            std::shared_ptr<void> storage;
+
+            size_t size() const {return positions.size();}
+            int32_t num_children(int32_t i) const {return child_offsets[i+1]-child_offsets[i];}
+            glm::mat4 frame(int32_t i) const {
+                return glm::mat4(glm::vec4(normals[i],0), glm::vec4(tangents[i],0),
+                                 glm::vec4(binormals[i],0), glm::vec4(positions[i],1));
+            }
+        };
+        Nodes shoot_nodes;
+        Nodes root_nodes;
+        const Nodes& get_nodes(path_type type) const {return type == LEAF ? shoot_nodes : root_nodes;}
+
+        // A path as a sequence of node indices, frames are looked up on access
+        struct Path{
+            const Nodes* nodes = nullptr;
+            std::span<const int32_t> indices;
+
+            size_t size() const {return indices.size();}
+            glm::vec3 position(size_t i) const {return nodes->positions[indices[i]];}
+            glm::mat4 frame(size_t i) const {return nodes->frame(indices[i]);}
+        };
+        // Appends the node indices from a tip down to the base
+        void get_path(size_t index, path_type type, std::vector<int32_t>& out) const;
+
+        enum Direction{
+            FORWARDS,
+            BACKWARDS
+        };
+        // Loads a text skeleton, or a binary one if the file ends in .skel
+        static Nodes load(const std::string& filename,
+            glm::mat4 init_frame=glm::mat4(0.f),
+            Direction dir=FORWARDS);
+        // Binary skeleton, see skeleton.cpp for the layout
+        static void save_binary(const Nodes& nodes, const std::string& filename,
+            bool with_frames=true);
 
     private:
         Mesh<VertFlat> get_mesh_frames();
@@ -57,25 +99,24 @@ class Skeleton{
             int num_nodes;
             float total_length;
         };
-        enum Direction{
-            FORWARDS,
-            BACKWARDS
-        };
-        static ParseInfo parse(std::shared_ptr<Node>& root,  
-            std::vector<std::shared_ptr<Node>>& leafs,
-            std::string filename,
-            glm::mat4 init_frame=glm::mat4(0.f),
-            Direction dir=FORWARDS);
+        // Reads positions and topology, has_frames is set if the frames were
+        // stored as well (forwards, no init frame)
+        static Nodes read(const std::string& filename, bool& has_frames);
+        static Nodes parse(const std::string& filename);
+        static Nodes load_binary(const std::string& filename, bool& has_frames);
+        static void compute_frames(Nodes& nodes, glm::mat4 init_frame, Direction dir);
         void transform();
-        void transform_dfs(Node& node, glm::mat4 t, glm::mat4 s, glm::mat4 r);
+        void transform_nodes(Nodes& nodes, glm::mat4 t, glm::mat4 s, glm::mat4 r);
         void calculate_stats();
-        void stats_dfs(Node& node, ParseInfo& stats);
+        static ParseInfo node_stats(const Nodes& nodes);
 
         ParseInfo shoot_stats;
         ParseInfo root_stats;
         std::pair<glm::vec3,glm::vec3> bounds;
         glm::vec3 center_of_mass;
         float average_length;
+        size_t parsed_bytes;
+        double parse_seconds;
 
         bool root_zup;
         bool shoot_zup;
@@ -55,13 +55,6 @@ std::vector<glm::vec3> Strands::smooth(const std::vector<glm::vec3> &in,
   return smoothed;
 }
 
-std::default_random_engine
-    rng(0);
-/*
-std::default_random_engine
-    rng(std::chrono::system_clock::now().time_since_epoch().count());
-    */
-
 Strands::Strands(const Skeleton &tree, Grid &grid, 
     nlohmann::json options)
     : grid(grid), tree(tree) {
@@ -69,39 +62,38 @@ Strands::Strands(const Skeleton &tree, Grid &grid,
   auto strand_options = options.at("strands");
   int root_prune_size = strand_options.at("root_prune_size");
   // Set up root & shoot paths
+  std::vector<std::pair<size_t,size_t>> shoot_ranges, root_ranges;
   for (size_t i = 0; i < tree.leafs_size(); i++) {
-    std::vector<glm::mat4> shoot_path = tree.get_strand(i, Skeleton::LEAF);
-    shoot_frames.push_back(shoot_path);
-    longest_shoot_length = std::max(longest_shoot_length, (int)shoot_frames.size());
+    size_t begin = path_nodes.size();
+    tree.get_path(i, Skeleton::LEAF, path_nodes);
+    shoot_ranges.push_back({begin, path_nodes.size() - begin});
+    longest_shoot_length = std::max(longest_shoot_length, (int)shoot_ranges.size());
   }
   for (size_t i = 0; i < tree.roots_size(); i++) {
-    std::vector<glm::mat4> root_frame = tree.get_strand(i, Skeleton::ROOT);
-    // Reverse the path
-    for (size_t i = 0; i < root_frame.size() / 2; i++) {
-      size_t j = root_frame.size() - 1 - i;
-      std::swap(root_frame[i], root_frame[j]);
-    }
+    size_t begin = path_nodes.size();
+    tree.get_path(i, Skeleton::ROOT, path_nodes);
+    size_t length = path_nodes.size() - begin;
     // Prune root paths
-    if (root_frame.size()>root_prune_size){
-      root_frames.push_back(root_frame);
-    }
-  }
-  std::unordered_map<glm::vec2, int32_t> temp_root_map;
-  root_2d_map = std::vector<std::vector<std::pair<int32_t, int32_t>>>();
-  for (size_t i = 0; i < root_frames.size(); i++) {
-    const std::vector<glm::mat4> &root_frame = root_frames[i];
-    for (size_t j = 0; j < root_frame.size(); j++) {
-      glm::vec3 p3d = frame_position(root_frame[j]);
-      glm::vec2 p2d = glm::vec2(p3d.x,p3d.z);
-      if (!temp_root_map.contains(p2d)){
-        root_2d.push_back(p2d);
-        root_2d_map.push_back(std::vector<std::pair<int32_t, int32_t>>());
-        temp_root_map.insert({p2d,root_2d.size()-1});
-      }
-      root_2d_map[temp_root_map[p2d]].push_back(std::make_pair(i, j));
+    if (length>root_prune_size){
+      // Reverse the path
+      std::reverse(path_nodes.begin() + begin, path_nodes.end());
+      root_ranges.push_back({begin, length});
+    } else {
+      path_nodes.resize(begin);
     }
   }
-  root_kdtree = KDTree(std::make_shared<std::vector<glm::vec2>>(root_2d));
+  // Views are only taken once path_nodes is done growing
+  path_nodes.shrink_to_fit();
+  for (auto [begin, length] : shoot_ranges)
+    shoot_paths.push_back({&tree.get_nodes(Skeleton::LEAF), {path_nodes.data() + begin, length}});
+  for (auto [begin, length] : root_ranges)
+    root_paths.push_back({&tree.get_nodes(Skeleton::ROOT), {path_nodes.data() + begin, length}});
+  std::vector<glm::vec3> path_positions;
+  path_positions.reserve(path_nodes.size());
+  for (const auto* paths : {&shoot_paths, &root_paths})
+    for (const Skeleton::Path& path : *paths)
+      for (size_t i = 0; i < path.size(); i++) path_positions.push_back(path.position(i));
+  path_bvh = PathBVH(std::move(path_positions));
   num_strands = tree.leafs_size();
   if (strand_options.contains("num_abs")) {
     num_strands = strand_options.at("num_abs");
@@ -114,13 +106,24 @@ Strands::Strands(const Skeleton &tree, Grid &grid,
     stages_left = strand_options.at("intermediate_stages");
   }
   strands_per_stage = num_strands / stages_left;
+  if (strand_options.contains("batch_size")) {
+    batch_size = std::max(1, (int)strand_options.at("batch_size"));
+  }
 
   max_val = strand_options.at("max_val");
   segment_length = strand_options.at("segment_length");
   num_trials = strand_options.at("num_trials");
   max_angle = strand_options.at("max_angle");
-  x_rand=std::uniform_real_distribution<float> (glm::cos(glm::radians(max_angle)), 1);
-  a_rand=std::uniform_real_distribution<float>(-glm::pi<float>(),glm::pi<float>());
+  trial_min_x = glm::cos(glm::radians(max_angle));
+  if (strand_options.contains("trial_wave")) {
+    trial_wave = std::max(0, (int)strand_options.at("trial_wave"));
+  }
+  if (strand_options.contains("trial_tolerance")) {
+    trial_tolerance = strand_options.at("trial_tolerance");
+  }
+  if (strand_options.contains("trial_refine")) {
+    trial_refine = std::clamp((float)strand_options.at("trial_refine"), 0.f, 1.f);
+  }
   // LA
   lookahead_factor_max = strand_options.at("lookahead_max");
   lookahead_factor_min = strand_options.at("lookahead_min");
@@ -132,6 +135,20 @@ Strands::Strands(const Skeleton &tree, Grid &grid,
   // LA reduction
   reduction_at_length = strand_options.at("reduction_at_length");
   reduction_length = strand_options.at("reduction_length");
+  path_arc.resize(path_nodes.size());
+  path_arc_reduced.resize(path_nodes.size());
+  for (const auto* paths : {&shoot_paths, &root_paths}) {
+    for (const Skeleton::Path& path : *paths) {
+      double* arc = path_arc.data() + path_offset(path);
+      double* arc_reduced = path_arc_reduced.data() + path_offset(path);
+      arc[0] = arc_reduced[0] = 0.0;
+      for (size_t i = 0; i + 1 < path.size(); i++) {
+        float step = glm::distance(path.position(i), path.position(i + 1));
+        arc[i + 1] = arc[i] + step;
+        arc_reduced[i + 1] = arc_reduced[i] + step * std::pow(2,(((float)i * std::log2(reduction_at_length))/(float)reduction_length));
+      }
+    }
+  }
   // Transition zone
   searchpoint_step = strand_options.at("searchpoint_step");
   bias_step = strand_options.at("bias_step");
@@ -151,19 +168,39 @@ Strands::Strands(const Skeleton &tree, Grid &grid,
   root_min_range = strand_options.at("root_min_range");
   if (leaf_min_range < 0) leaf_min_range = base_max_range;
   if (root_min_range < 0) root_min_range = base_max_range;
+  // Root matching looks at (x,z), and at depth too when root_match_depth
+  // gives the y axis some weight. Nodes landing on the same point share it
+  if (strand_options.contains("root_match_depth")) {
+    root_match_depth = strand_options.at("root_match_depth");
+  }
+  std::unordered_map<glm::vec3, int32_t> temp_root_map;
+  std::vector<glm::vec3> root_points;
+  for (size_t i = 0; i < root_paths.size(); i++) {
+    const Skeleton::Path &root_path = root_paths[i];
+    for (size_t j = 0; j < root_path.size(); j++) {
+      glm::vec3 p = root_match_point(root_path.position(j));
+      auto [it, inserted] = temp_root_map.try_emplace(p, root_points.size());
+      if (inserted) {
+        root_points.push_back(p);
+        root_point_map.emplace_back();
+      }
+      root_point_map[it->second].push_back(std::make_pair(i, j));
+    }
+  }
+  root_kdtree = KDTree(root_points);
   // Initialize Root Angle Vectors
   root_angle_node =
       std::clamp((float)strand_options.at("root_angle_node"), 0.05f, 1.f);
-  root_vecs.reserve(root_frames.size());
-  for (size_t i = 0; i < root_frames.size(); i++) {
+  root_vecs.reserve(root_paths.size());
+  for (size_t i = 0; i < root_paths.size(); i++) {
     glm::vec3 angle_vec =
-        frame_position(
-            root_frames[i][std::max(20,(int)root_frames[i].size() - 100)]) -
+        root_paths[i].position(std::max(20,(int)root_paths[i].size() - 100)) -
         tree.get_root_pos();
     angle_vec.y = 0.f;
     angle_vec = glm::normalize(angle_vec);
     root_vecs.push_back(angle_vec);
   }
+  root_pool = AngleIndex(root_vecs);
   start_offset = strand_options.at("start_offset");
 }
 
@@ -270,29 +307,71 @@ int Strands::add_stage(){
 }
 
 void Strands::add_strands(unsigned int amount) {
-  std::vector<size_t> paths(shoot_frames.size());
+  std::vector<size_t> paths(shoot_paths.size());
   std::iota(paths.begin(), paths.end(), 0);
   std::shuffle(paths.begin(), paths.end(), rng);
-  for (size_t i = 0; i < amount; i++) {
-    if ((i+1)%5==0 || i+1 == amount){
-      std::cout << "\rStrand: " << i+1 << "/" << amount;
-      std::flush(std::cout);
+  // Strands in a batch grow against the same field and are only filled in
+  // once the whole batch is done, so the result depends only on batch_size
+  for (size_t i = 0; i < amount; i += batch_size) {
+    const int batch = std::min((size_t)batch_size, amount - i);
+    const size_t first_id = node_info.size();
+    const size_t first_strand = strands.size();
+    std::vector<Growth> grown(batch);
+    auto start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic) if (batch > 1)
+    for (int j = 0; j < batch; j++) {
+      std::seed_seq seed{(uint32_t)(first_id + j)};
+      std::default_random_engine gen(seed);
+      float lookahead_max = lookahead_factor_min + laf_step*(first_strand + j);
+      grown[j] = grow_strand(first_id + j, paths[(i + j) % paths.size()],
+                             lookahead_max, gen);
     }
-    strand_lookahead_max = lookahead_factor_min + laf_step*strands.size();
-    add_strand(paths[i % paths.size()], i);
+    auto grown_at = std::chrono::steady_clock::now();
+    profile.grow += std::chrono::duration<double>(grown_at - start).count();
+    for (int j = 0; j < batch; j++) {
+      if ((i+j+1)%5==0 || i+j+1 == amount){
+        std::cout << "\rStrand: " << i+j+1 << "/" << amount;
+        std::flush(std::cout);
+      }
+      commit_strand(grown[j]);
+    }
+    profile.fill += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - grown_at).count();
   }
   std::cout << "\rTotal Strands: " << strands.size() << "/" << num_strands << std::endl;
   std::cout << std::endl;
 }
 
-// THE ALGORITHM THAT IMPLEMENTS STRAND VOXEL AUTOMATA
-void Strands::add_strand(size_t shoot_index, int age) {
-  if (shoot_index >= shoot_frames.size())
+void Strands::commit_strand(const Growth &grown) {
+  if (!grown.started)
+    return;
+  if (grown.matched_root) take_root(*grown.matched_root);
+  inflection_points.push_back(grown.inflection_point);
+  node_info.push_back(grown.node_info);
+  keypoints.push_back(grown.keypoints);
+  // Occupy strand path
+  if (grown.strand.size() <= 2)
     return;
+  strands.push_back(grown.strand);
+  assert(grown.strand.size() == node_info.back().size());
+  assert(strands.size() == node_info.size());
+  grid.fill_path(strands.size(), grown.strand, max_val, 
+      base_max_range, leaf_min_range, root_min_range, grown.inflection);
+}
+
+// THE ALGORITHM THAT IMPLEMENTS STRAND VOXEL AUTOMATA
+// Only reads the grid, the strand is filled in by commit_strand
+Strands::Growth Strands::grow_strand(size_t strand_id, size_t shoot_index,
+                                     float strand_lookahead_max,
+                                     std::default_random_engine &gen) {
+  Growth grown;
+  if (shoot_index >= shoot_paths.size())
+    return grown;
+  grown.started = true;
   // Set up strand
-  const std::vector<glm::mat4> *shoot_path = &(shoot_frames[shoot_index]);
-  const std::vector<glm::mat4> *root_path = nullptr;
-  const std::vector<glm::mat4> *path = shoot_path;
+  const Skeleton::Path *shoot_path = &shoot_paths[shoot_index];
+  const Skeleton::Path *root_path = nullptr;
+  const Skeleton::Path *path = shoot_path;
 
   // Binary search for start index
   // use int so it can go negative (will be clamped)
@@ -302,7 +381,7 @@ void Strands::add_strand(size_t shoot_index, int age) {
   int transition_nodes=0;
   while (b - a > 5) {
     i_closest_index = a + (b - a) / 2;
-    if (grid.eval_pos(frame_position((*path)[i_closest_index])) <= 0.01f) {
+    if (grid.eval_pos(path->position(i_closest_index)) <= 0.01f) {
       a = i_closest_index;
     } else {
       b = i_closest_index;
@@ -313,25 +392,23 @@ void Strands::add_strand(size_t shoot_index, int age) {
       i_closest_index-start_offset, 0, (int)shoot_path->size());
   //
   
-  glm::mat4 last_closest = (*path)[closest_index];
+  glm::mat4 last_closest = path->frame(closest_index);
   std::vector<glm::vec3> strand{frame_position(last_closest)};
 
   // SETUP AUXILARY INFO
-  inflection_points.push_back({0, 0});
+  std::vector<NodeInfo> &node_info = grown.node_info;
   node_info.push_back({});
-  node_info.back().push_back({});
-  node_info.back().back().closest=frame_position(last_closest);
-  node_info.back().back().searchpoint=frame_position(last_closest);
-  node_info.back().back().target=frame_position(last_closest);
+  node_info.back().closest=frame_position(last_closest);
+  node_info.back().searchpoint=frame_position(last_closest);
+  node_info.back().target=frame_position(last_closest);
   // SETUP AUXILARY INFO
 
   // Set up lookahead value
   const int la_start_node = std::clamp((int)(shoot_path->size() - 1) - la_interp_start, 0, (int)shoot_path->size() - 1);
   const int la_peak_node = std::clamp((int)(shoot_path->size() - 1) - la_interp_peak , 0, (int)shoot_path->size() - 1);
-  keypoints.push_back(Keypoints());
-  keypoints.back().la_start=frame_position((*shoot_path)[la_start_node]);
-  keypoints.back().la_peak=frame_position((*shoot_path)[la_peak_node]);
-  keypoints.back().base_node=frame_position((*shoot_path)[shoot_path->size()-1]);
+  grown.keypoints.la_start=shoot_path->position(la_start_node);
+  grown.keypoints.la_peak=shoot_path->position(la_peak_node);
+  grown.keypoints.base_node=shoot_path->position(shoot_path->size()-1);
   //  Loop until on root, and target node is the end
   bool on_root = false;
   bool target_on_root = false;
@@ -341,7 +418,9 @@ void Strands::add_strand(size_t shoot_index, int age) {
   int num_extensions;
   // difference between root closest and target when in transition zone
   float idx_diff=0.f; 
-
+  // Transition zone interpolation
+  float _interp = 0.f;
+  float _interp_bias = 0.f;
   while (!done) {
     if (on_root) {
       num_extensions--;
@@ -368,17 +447,18 @@ void Strands::add_strand(size_t shoot_index, int age) {
       // Target is in transition area but the target here crept back onto shoot
       // so we nudge it back into the root so things dont crash
       target.index = 0;
-      target.frame = (*root_path)[0];
+      target.frame = root_path->frame(0);
     }
     if (target.index == path->size() - 1) {
       if (!on_root) { // switch path
         if (!target_on_root) {
-          inflection_points[inflection_points.size() - 1].first =
+          grown.inflection_point.first =
               strand.size() - 1;
           target_on_root = true;
           if (root_path == nullptr) {
-            root_path = &(root_frames[match_root(strand[strand.size() - 1],
-                                                 (*path)[closest_index])]);
+            grown.matched_root = match_root(strand[strand.size() - 1],
+                                            path->frame(closest_index), gen);
+            root_path = &(root_paths[*grown.matched_root]);
             transition_node = closest_index;
           }
         }
@@ -393,13 +473,14 @@ void Strands::add_strand(size_t shoot_index, int age) {
     float current_bias = !(target_on_root || on_root) ?
       1.0 : (1 - _interp_bias) + bias_amount * _interp_bias;
     std::optional<glm::vec3> ext = find_extension(
-        strand.back(), last_closest, target.frame, current_bias);
+        strand.back(), last_closest, target.frame,
+        CounterRng(strand_id, strand.size()), current_bias);
     if (!ext) {
       ext = find_extension_canoniso(strand.back(), last_closest, target.frame);
     }
     strand.push_back(ext.value());
-    node_info.back().push_back({});
-    node_info.back().back().target=frame_position(target.frame);
+    node_info.push_back({});
+    node_info.back().target=frame_position(target.frame);
 
     TargetResult next;
     if (!on_root && target_on_root) {
@@ -421,7 +502,7 @@ void Strands::add_strand(size_t shoot_index, int age) {
         on_root = true;
         inflection = strand.size() - 1;
         num_extensions = strand.size();
-        inflection_points[inflection_points.size() - 1].second =
+        grown.inflection_point.second =
             strand.size() - 1;
       }
     } else {
@@ -437,8 +518,8 @@ void Strands::add_strand(size_t shoot_index, int age) {
       _interp = 0.f;
       _interp_bias = 0.f;
     }
-    node_info.back().back().closest=frame_position(next.frame);
-    node_info.back().back().searchpoint=frame_position(next.frame);
+    node_info.back().closest=frame_position(next.frame);
+    node_info.back().searchpoint=frame_position(next.frame);
     if (target_on_root && !on_root) { // transition zone
       TargetResult root_closest =
           find_closest(strand.back(), *root_path, 0, target.index);
@@ -449,20 +530,20 @@ void Strands::add_strand(size_t shoot_index, int age) {
       strand[strand.size() - 1] =
         move_extension(strand.back(), bin_point, reject_iso);
       // fallback
-      node_info.back().back().searchpoint=bin_point;
-      node_info.back().back().closest2=frame_position(root_closest.frame);
-      node_info.back().back().transition=true;
+      node_info.back().searchpoint=bin_point;
+      node_info.back().closest2=frame_position(root_closest.frame);
+      node_info.back().transition=true;
     } else if (!on_root) { // shoot
       strand[strand.size() - 1] = move_extension(
           strand.back(), frame_position(next.frame), reject_iso);
     } else { // root
       int bin_point_idx=std::min(next.index+(int)(idx_diff), root_path->size()-1);
       assert(bin_point_idx>=next.index && bin_point_idx <=root_path->size()-1);
-      glm::vec3 bin_point=frame_position((*root_path)[bin_point_idx]);
+      glm::vec3 bin_point=root_path->position(bin_point_idx);
       strand[strand.size() - 1] = move_extension(
           strand.back(), bin_point, reject_iso);
 
-      node_info.back().back().searchpoint=bin_point;
+      node_info.back().searchpoint=bin_point;
       idx_diff=idx_diff-root_searchpoint_delta;
       if (idx_diff <= 0.f) idx_diff=0.f;
     }
@@ -476,12 +557,12 @@ void Strands::add_strand(size_t shoot_index, int age) {
       done = true;
     }
     if ((on_root && root_nodes%5==0) || (!on_root && target_on_root && transition_nodes%20==0)){
-      auto p = match_root_all(strand.back());
-      root_path = &(root_frames[p.first]);
+      auto p = match_root_all(strand.back(), gen);
+      root_path = &(root_paths[p.first]);
       if (on_root){
         path = root_path;
-        closest_index = std::max((size_t)0,p.second-1);
-        last_closest = (*path)[closest_index];
+        closest_index = p.second > 0 ? p.second-1 : 0;
+        last_closest = path->frame(closest_index);
       }
     }else{
       closest_index = next.index;
@@ -491,43 +572,33 @@ void Strands::add_strand(size_t shoot_index, int age) {
     if (!on_root && target_on_root) transition_nodes++;
   }
 
-  // Occupy strand path
   if (strand.size() <= 2)
-    return;
-  float r = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-  strand = smooth(strand, sm_iter, sm_peak, sm_min, inflection * sm_start,
+    return grown;
+  grown.strand = smooth(strand, sm_iter, sm_peak, sm_min, inflection * sm_start,
                   inflection,
                   inflection + ((strand.size() - inflection - 1) * sm_end));
-  strands.push_back(strand);
-  assert(strand.size() == node_info.back().size());
-  assert(strands.size() == node_info.size());
-  grid.fill_path(strands.size(), strand, max_val, 
-      base_max_range, leaf_min_range, root_min_range, inflection);
+  grown.inflection = inflection;
+  return grown;
 }
 
 // Strand creation helper functions
 // TODO: LOOK AT REDUCE MORE CLOSELY
-Strands::TargetResult Strands::find_target(const std::vector<glm::mat4> &path,
+Strands::TargetResult Strands::find_target(const Skeleton::Path &path,
                                            size_t start_index,
                                            float travel_dist, bool reduce) {
-  TargetResult result = {start_index, path[start_index], 0.f};
-  glm::vec3 target_point = frame_position(path[result.index]);
-  while (result.travelled < travel_dist && result.index != path.size() - 1) {
-    float travelled = glm::distance(frame_position(path[result.index]), frame_position(path[result.index + 1]));
-    if (reduce) travelled = travelled * std::pow(2,(((float)result.index * std::log2(reduction_at_length))/(float)reduction_length));
-    result.travelled += travelled;
-    result.index++;
-    result.frame = path[result.index];
-  }
+  // First node at least travel_dist along, or the end of the path
+  const double* arc = (reduce ? path_arc_reduced : path_arc).data() + path_offset(path);
+  size_t last = path.size() - 1;
+  size_t index = std::lower_bound(arc + start_index, arc + last, arc[start_index] + travel_dist) - arc;
+  TargetResult result = {index, path.frame(index), (float)(arc[index] - arc[start_index])};
   // Travelled further than allowed
-  if (reduce || result.index == path.size() - 1) {
-    result.frame = path[result.index];
-    if (reduce) result.travelled = travel_dist;
-  } else if (result.travelled > travel_dist && result.index != 0) {
+  if (reduce) {
+    result.travelled = travel_dist;
+  } else if (result.index != last && result.travelled > travel_dist && result.index != 0) {
     result.index--;
-    glm::vec3 p1 = frame_position(path[result.index]);
-    glm::vec3 p2 = frame_position(path[result.index + 1]);
-    result.frame = path[result.index];
+    glm::vec3 p1 = path.position(result.index);
+    glm::vec3 p2 = path.position(result.index + 1);
+    result.frame = path.frame(result.index);
     glm::vec3 last_step = p2 - p1;
     float left_to_travel = result.travelled - travel_dist;
     result.frame[3] =
@@ -541,6 +612,7 @@ Strands::TargetResult Strands::find_target(const std::vector<glm::mat4> &path,
 std::optional<glm::vec3> Strands::find_extension(glm::vec3 from,
                                                  glm::mat4 frame_from,
                                                  glm::mat4 frame_to,
+                                                 const CounterRng &trial_rng,
                                                  float bias) {
   glm::vec3 target_point = frame_position(frame_to);
   glm::vec3 canonical_direction =
@@ -551,36 +623,81 @@ std::optional<glm::vec3> Strands::find_extension(glm::vec3 from,
     glm::vec3 head;
     float distance;
   };
-  std::vector<Trial> trials(num_trials, {glm::vec3(), FLT_MAX});
   float slack=0.5;
   const glm::vec3 x_axis(1.f,0,0);
   if (-x_axis==canonical_direction) canonical_direction = glm::normalize(glm::vec3(-.096f,0.14f,0.f));
   const glm::quat rotation=glm::angleAxis(glm::angle(canonical_direction, x_axis),
                                       glm::normalize(glm::cross(x_axis, canonical_direction)));
+  glm::vec3 biased_point = target_point;
+  biased_point.y /= bias;
+  auto biased_distance = [&](glm::vec3 head) {
+    head.y /= bias;
+    return glm::distance(head, biased_point);
+  };
+
+  // Trials go in waves of trial_wave. The first wave covers the whole cone,
+  // later ones sample a narrowing cone around the best head so far. Stops
+  // once the best is within trial_tolerance of heading straight at the
+  // target, when a narrowed wave gains less than that, or after num_trials.
+  // trial_wave 0 is one wave of num_trials
+  int wave_size = trial_wave > 0 ? std::min(trial_wave, num_trials) : num_trials;
+  float ideal = biased_distance(from + segment_length * glm::normalize(target_point - from));
+  Trial best = {glm::vec3(), FLT_MAX};
+  float refine_angle = max_angle * trial_refine;
+  std::vector<glm::vec3> heads(wave_size);
+  std::vector<float> vals(wave_size);
+  std::vector<uint8_t> in_cone(wave_size, true);
+  for (int start = 0; start < num_trials; start += wave_size) {
+    int size = std::min(wave_size, num_trials - start);
+    // Narrow in on the best head, or keep covering the cone until one is found
+    glm::quat wave_rotation = rotation;
+    float min_x = trial_min_x;
+    bool refine = start > 0 && best.distance != FLT_MAX;
+    if (refine) {
+      glm::vec3 best_direction = glm::normalize(best.head - from);
+      glm::vec3 axis = glm::cross(x_axis, best_direction);
+      // Straight along -x any axis perpendicular to x turns the wave around
+      if (glm::length2(axis) > 0.f)
+        wave_rotation = glm::angleAxis(glm::angle(best_direction, x_axis), glm::normalize(axis));
+      else if (best_direction.x < 0.f)
+        wave_rotation = glm::angleAxis(glm::pi<float>(), glm::vec3(0.f, 1.f, 0.f));
+      else
+        wave_rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
+      min_x = glm::cos(glm::radians(refine_angle));
+      refine_angle *= 0.5f;
+    }
+    // Each thread generates a block of trials and evaluates it while the
+    // heads are still in cache
+    int num_blocks = (size + Grid::eval_block - 1) / Grid::eval_block;
 #pragma omp parallel for
-  for (int i = 0; i < num_trials; i++) {
-    glm::vec3 r_vec = random_vector(rotation);
-    glm::vec3 trial_head = from + segment_length * r_vec;
-    assert(!glm::any(glm::isnan(from)));
-    assert(!glm::any(glm::isnan(r_vec)));
-    assert(!glm::any(glm::isnan(trial_head)));
-
-    float val = grid.eval_pos(trial_head);
-    if (val>=reject_iso) continue;
-
-    glm::vec3 biased_head = trial_head;
-    biased_head.y /= bias;
-    glm::vec3 biased_point = target_point;
-    biased_point.y /= bias;
-    float distance = glm::distance(biased_head, biased_point);
-    trials[i].head = trial_head;
-    trials[i].distance = distance;
-  }
+    for (int b = 0; b < num_blocks; b++) {
+      int block_start = b * Grid::eval_block;
+      int block_size = std::min(Grid::eval_block, size - block_start);
+      for (int i = block_start; i < block_start + block_size; i++) {
+        glm::vec3 r_vec = random_vector(wave_rotation, min_x, trial_rng, start + i);
+        heads[i] = from + segment_length * r_vec;
+        // Refined trials may poke out of the cone around the canonical direction
+        in_cone[i] = !refine || glm::dot(r_vec, canonical_direction) >= trial_min_x;
+        assert(!glm::any(glm::isnan(from)));
+        assert(!glm::any(glm::isnan(r_vec)));
+        assert(!glm::any(glm::isnan(heads[i])));
+      }
+      grid.eval_pos_batch(std::span(heads).subspan(block_start, block_size),
+                          std::span(vals).subspan(block_start, block_size));
+    }
 
-  auto res = std::max_element(trials.begin(), trials.end(),
-      [](const auto& a, const auto& b){return a.distance>b.distance;});
-  if (res->distance==FLT_MAX) return {};
-  return res->head;
+    float last_best = best.distance;
+    for (int i = 0; i < size; i++) {
+      if (vals[i]>=reject_iso || !in_cone[i]) continue;
+      float distance = biased_distance(heads[i]);
+      if (distance < best.distance) best = {heads[i], distance};
+    }
+    float tolerance = trial_tolerance * segment_length;
+    if (best.distance - ideal <= tolerance) break;
+    if (refine && last_best - best.distance <= tolerance) break;
+  }
+  if (best.distance==FLT_MAX) return {};
+  return best.head;
 }
 
 glm::vec3 Strands::find_extension_canoniso(glm::vec3 from, glm::mat4 frame_from,
@@ -658,92 +775,79 @@ glm::vec3 Strands::move_extension(glm::vec3 head, glm::vec3 close, float iso) {
   return new_head;
 }
 
+// Where a path's nodes start in path_nodes, and so in path_bvh and path_arc
+size_t Strands::path_offset(const Skeleton::Path& path) const {
+  size_t offset = path.indices.data() - path_nodes.data();
+  assert(offset + path.size() <= path_nodes.size());
+  return offset;
+}
+
 Strands::TargetResult Strands::find_closest(glm::vec3 pos,
-                                            const std::vector<glm::mat4> &path,
+                                            const Skeleton::Path &path,
                                             int start_index, int end_index) {
   //  FIXME: CHECK THESE ASSERTIONS
   assert(start_index >= 0 && start_index < path.size());
   assert(end_index >= start_index && start_index < path.size());
-  size_t closest_index = start_index;
-  float lowest_dist2 = glm::distance2(pos, frame_position(path[closest_index]));
-
-  for (int i = start_index; i <= end_index; i++) {
-    float dist2 = glm::distance2(pos, frame_position(path[i]));
-    if (dist2 < lowest_dist2) {
-      lowest_dist2 = dist2;
-      closest_index = i;
-    }
-  }
-  return {closest_index, path[closest_index], lowest_dist2};
+  size_t offset = path_offset(path);
+  auto [closest, lowest_dist2] =
+      path_bvh.closest(pos, offset + start_index, offset + end_index);
+  size_t closest_index = closest - offset;
+  return {closest_index, path.frame(closest_index), lowest_dist2};
+}
+
+glm::vec3 Strands::root_match_point(glm::vec3 pos) const {
+  // Adding zero turns -0 into 0, they compare equal but hash differently
+  pos.y = pos.y * root_match_depth + 0.0f;
+  return pos;
 }
 
-std::pair<size_t,size_t> Strands::match_root_all(glm::vec3 position) {
-  glm::vec2 pos2 = glm::vec2(position.x,position.z);
-  int32_t best_node = root_kdtree.find_nearest(pos2);
-  std::vector<std::pair<int32_t, int32_t>> best_strands=root_2d_map[best_node];
-  auto r = best_strands[(size_t)std::rand() % best_strands.size()];
+std::pair<size_t,size_t> Strands::match_root_all(glm::vec3 position,
+                                                 std::default_random_engine &gen) {
+  int32_t best_node = root_kdtree.find_nearest(root_match_point(position));
+  const std::vector<std::pair<int32_t, int32_t>> &best_strands=root_point_map[best_node];
+  auto r = best_strands[(size_t)gen() % best_strands.size()];
   return r;
 }
 
-size_t Strands::match_root(glm::vec3 position, glm::mat4 frame) {
-  if (root_pool.empty()) {
-    if (select_pool == All) {
-      for (size_t i = 0; i < root_frames.size(); ++i) {
-          root_pool.push_back(i);
-      }
-    } else {
-      root_pool.resize(root_frames.size());
-      std::iota(root_pool.begin(), root_pool.end(), 0);
-    }
-  }
-  size_t match_index = 0;
+// Only reads the pool, so every strand of a batch picks from it as it was
+// at the start of the batch. take_root updates it on commit
+size_t Strands::match_root(glm::vec3 position, glm::mat4 frame,
+                           std::default_random_engine &gen) const {
+  size_t match = 0;
   if (select_method == AtRandom) {
-    match_index = rng() % root_pool.size();
+    match = root_pool.nth(gen() % root_pool.size());
   } else if (select_method == WithAngle) {
-    // CHECK  THIS
-    std::vector<size_t> possible_matches = {};
     glm::vec3 angle_vec = position - tree.get_root_pos();
     angle_vec.y = 0.f;
     angle_vec = glm::normalize(angle_vec);
-    double largest_cos = -1.f;
-    assert("Root pool empty" && root_pool.size() != 0);
-    for (size_t j = 0; j < root_pool.size(); j++) {
-      double cos = glm::dot(angle_vec, root_vecs[root_pool[j]]);
-      if (cos == largest_cos) {
-        possible_matches.push_back(j);
-      } else if (cos > largest_cos) {
-        largest_cos = cos;
-        possible_matches.clear();
-        possible_matches.push_back(j);
-      }
-    }
-    // assert(!possible_matches.empty());
+    std::vector<size_t> possible_matches = root_pool.closest(angle_vec);
     if (!possible_matches.empty()) {
-      int i = std::rand() % possible_matches.size();
-      // std::cout<<' '<<i<<' '<<possible_matches.size()<<std::endl;
-      match_index = possible_matches[i];
+      match = possible_matches[gen() % possible_matches.size()];
     } else { // Shouldn't happen but idk
       std::cout << "No matches for: " << position << std::endl;
-      // assert("No root matches" && !possible_matches.empty());
-      match_index = (int)std::rand() % root_pool.size();
-    }
-    //
-  }
-  size_t match = root_pool[match_index];
-  if (select_pool == NotSelected || select_pool == AtLeastOnce) {
-    root_pool.erase(root_pool.begin() + match_index);
-    if (root_pool.empty() && select_pool == AtLeastOnce) {
-      select_pool = All;
+      match = root_pool.nth(gen() % root_pool.size());
     }
   }
   return match;
 }
 
-glm::vec3 Strands::random_vector(glm::quat rotation) {
+// Called in strand order, so the pool doesn't depend on how the threads ran.
+// Strands of one batch may have picked the same root
+void Strands::take_root(size_t root) {
+  if (select_pool != NotSelected && select_pool != AtLeastOnce) return;
+  if (root_pool.contains(root)) root_pool.remove(root);
+  if (root_pool.size() == 0) {
+    if (select_pool == AtLeastOnce) select_pool = All;
+    root_pool.reset();
+  }
+}
+
+glm::vec3 Strands::random_vector(glm::quat rotation, float min_x,
+                                 const CounterRng &trial_rng, uint64_t trial) {
   // CODE CITED
   // from https://community.khronos.org/t/random-vectors/41467/3 imported_jwatte
-  float x = x_rand(rng);
-  float a = a_rand(rng);
+  float x = min_x + (1.f - min_x) * trial_rng.uniform(2 * trial);
+  float a = glm::pi<float>() * (2.f * trial_rng.uniform(2 * trial + 1) - 1.f);
   float r = glm::fastSqrt(1 - x * x);
   float y = glm::fastSin(a) * r;
   float z = glm::fastCos(a) * r;
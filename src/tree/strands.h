@@ -16,10 +16,13 @@
 #include "tree/grid.h"
 #include "tree/implicit.h"
 #include "tree/skeleton.h"
+#include "tree/angle_index.h"
 #include "tree/kdtree.h"
+#include "tree/path_bvh.h"
 #include <nlohmann/json.hpp>
 
 #include "util/geometry.h"
+#include "util/random.h"
 
 class Strands {
 public:
@@ -30,20 +33,15 @@ public:
     Mesh<Vertex> visualize_keypoints(float strand) const;
     void add_strands(unsigned int amount);
     int add_stage();
+    // Seconds spent growing strands (find_target, find_extension) and
+    // filling them into the grid, over every add_strands call
+    struct Profile{
+      double grow = 0.0;
+      double fill = 0.0;
+    };
+    const Profile& get_profile() const { return profile; }
 
 private:
-    void add_strand(size_t shoot_index, int age);
-    size_t match_root(glm::vec3 pos, glm::mat4 frame);
-    std::pair<size_t,size_t> match_root_all(glm::vec3 pos);
-    const Skeleton& tree;
-    // Change to vec3
-    std::vector<std::vector<glm::mat4>> shoot_frames;
-    std::vector<std::vector<glm::mat4>> root_frames;
-    //
-    std::vector<std::vector<glm::vec3>> strands;
-    std::vector<std::pair<size_t,size_t>> inflection_points;
-    std::vector<std::vector<glm::vec3>> texture_strands;
-
     struct NodeInfo{
       glm::vec3 closest;
       glm::vec3 target;
@@ -51,8 +49,6 @@ private:
       glm::vec3 searchpoint;
       bool transition=false;
     };
-    std::vector<std::vector<NodeInfo>> node_info;
-
     struct Keypoints {
       glm::vec3 la_start;
       glm::vec3 la_peak;
@@ -60,12 +56,52 @@ private:
       glm::vec3 transition_node;
       glm::vec3 enter_root_node;
     };
+    // A grown strand that has not been filled into the grid yet
+    struct Growth {
+      bool started = false;
+      std::vector<glm::vec3> strand;
+      std::vector<NodeInfo> node_info;
+      Keypoints keypoints;
+      std::pair<size_t,size_t> inflection_point = {0, 0};
+      size_t inflection = 0;
+      // Root picked by match_root, taken out of the pool on commit
+      std::optional<size_t> matched_root;
+    };
+    Growth grow_strand(size_t strand_id, size_t shoot_index,
+        float strand_lookahead_max, std::default_random_engine& gen);
+    void commit_strand(const Growth& grown);
+    size_t match_root(glm::vec3 pos, glm::mat4 frame, std::default_random_engine& gen) const;
+    void take_root(size_t root);
+    std::pair<size_t,size_t> match_root_all(glm::vec3 pos, std::default_random_engine& gen);
+    const Skeleton& tree;
+    // Node indices of every shoot and root path back to back, the paths are
+    // views into this rather than copies of each frame
+    std::vector<int32_t> path_nodes;
+    std::vector<Skeleton::Path> shoot_paths;
+    std::vector<Skeleton::Path> root_paths;
+    // Positions along path_nodes, for find_closest
+    PathBVH path_bvh;
+    // Arc length from the start of each path to every node along path_nodes,
+    // and the same with the steps scaled up for find_target's reduce
+    std::vector<double> path_arc;
+    std::vector<double> path_arc_reduced;
+    size_t path_offset(const Skeleton::Path& path) const;
+    //
+    std::vector<std::vector<glm::vec3>> strands;
+    std::vector<std::pair<size_t,size_t>> inflection_points;
+    std::vector<std::vector<glm::vec3>> texture_strands;
+
+    std::vector<std::vector<NodeInfo>> node_info;
     std::vector<Keypoints> keypoints;
 
     Grid &grid;
+    // Root nodes by position for match_root_all, each point lists the
+    // (root path, node) pairs found there
     KDTree root_kdtree;
-    std::vector<std::vector<std::pair<int32_t, int32_t>>> root_2d_map;
-    std::vector<glm::vec2> root_2d;
+    std::vector<std::vector<std::pair<int32_t, int32_t>>> root_point_map;
+    // Weight of depth against (x,z) distance when matching roots
+    float root_match_depth = 0.0f;
+    glm::vec3 root_match_point(glm::vec3 pos) const;
 
     // Strand Creation Helper Functions
     std::vector<glm::vec3> smooth(
@@ -84,14 +120,16 @@ private:
         float distance;
         float angle;
     };
-    TargetResult find_target(const std::vector<glm::mat4>& path, size_t start_index, float travel_dist, bool reduce = false);
-    std::optional<glm::vec3> find_extension(glm::vec3 from, glm::mat4 frame_from, glm::mat4 frame_to, float bias=1.0);
+    TargetResult find_target(const Skeleton::Path& path, size_t start_index, float travel_dist, bool reduce = false);
+    std::optional<glm::vec3> find_extension(glm::vec3 from, glm::mat4 frame_from, glm::mat4 frame_to, const CounterRng& trial_rng, float bias=1.0);
     glm::vec3 find_extension_canoniso(glm::vec3 from, glm::mat4 frame_from, glm::mat4 frame_to, bool bias=false, float bias_amount = 1.0f);
-    TargetResult find_closest(glm::vec3 pos, const std::vector<glm::mat4>& path, int start_index, int end_index);
+    TargetResult find_closest(glm::vec3 pos, const Skeleton::Path& path, int start_index, int end_index);
 
     int num_strands;
     int stages_left;
     int strands_per_stage;
+    // Strands grown concurrently against the same field
+    int batch_size = 1;
     //
     int longest_shoot_length=0;
     //
@@ -106,10 +144,7 @@ private:
     // Experimental
     int start_offset=20;
     float bsearch_iso;
-    float _interp;
-    float _interp_bias;
     // Lookahead Vars
-    float strand_lookahead_max;
     float lookahead_factor_min = 1.0f;
     float lookahead_factor_max = 2.0f;
     float laf_step;
@@ -152,12 +187,24 @@ private:
         AtLeastOnce,
     } select_pool = All;
 
-    std::vector<size_t> root_pool;
+    // Shuffles the shoot paths, kept per tree so trees built in the same
+    // process don't depend on each other
+    std::default_random_engine rng{0};
+
+    // Roots match_root can still pick, by the direction of root_vecs
+    AngleIndex root_pool;
     std::vector<glm::vec3> root_vecs;
 
-    std::uniform_real_distribution<float> x_rand;
-    std::uniform_real_distribution<float> a_rand;
-    glm::vec3 random_vector(glm::quat rotation);
+    // Cosine of max_angle, lower bound of a trial's x component
+    float trial_min_x;
+    // Adaptive trials, see find_extension. Tolerance is a fraction of
+    // segment_length, refine the first narrowed cone as a fraction of max_angle
+    int trial_wave = 0;
+    float trial_tolerance = 0.01f;
+    float trial_refine = 0.25f;
+    // Random direction within acos(min_x) of rotation's x axis
+    glm::vec3 random_vector(glm::quat rotation, float min_x, const CounterRng& trial_rng, uint64_t trial);
 
     int strands_terminated = 0;
+    Profile profile;
 };
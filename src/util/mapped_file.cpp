@@ -0,0 +1,36 @@
+#include "util/mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& filename){
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Could not open " + filename + ": " + std::strerror(errno));
+  struct stat info;
+  if (fstat(fd, &info) != 0){
+    close(fd);
+    throw std::runtime_error("Could not stat " + filename + ": " + std::strerror(errno));
+  }
+  length = info.st_size;
+  if (length > 0){
+    void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED){
+      close(fd);
+      throw std::runtime_error("Could not map " + filename + ": " + std::strerror(errno));
+    }
+    bytes = static_cast<std::byte*>(mapped);
+  }
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+}
+
+MappedFile::~MappedFile(){
+  if (bytes) munmap(bytes, length);
+}
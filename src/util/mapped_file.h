@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// A whole file mapped into memory. Pages are mapped private, so writes stay
+// in this process (copy on write) and never reach the file.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& filename);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  std::byte* data() { return bytes; }
+  const std::byte* data() const { return bytes; }
+  size_t size() const { return length; }
+private:
+  std::byte* bytes = nullptr;
+  size_t length = 0;
+};
@@ -0,0 +1,134 @@
+#include "util/ply_writer.h"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <stdexcept>
+
+static_assert(std::endian::native == std::endian::little,
+              "PLY files are written little endian");
+
+namespace {
+// x y z nx ny nz as floats, then red green blue as uchars
+constexpr size_t vertex_bytes = 6*sizeof(float)+3;
+// uchar count then three int indices
+constexpr size_t face_bytes = 1+3*sizeof(int32_t);
+// Records are gathered and written in blocks of about this size
+constexpr size_t flush_bytes = 1<<20;
+// Counts are zero padded to this many digits so they can be patched in place
+constexpr int count_width = 12;
+
+template <typename T>
+char* put(char* dst, const T& value){
+  std::memcpy(dst, &value, sizeof(T));
+  return dst+sizeof(T);
+}
+
+void put_count(std::ofstream& out, size_t count){
+  out<<std::setw(count_width)<<std::setfill('0')<<count;
+}
+}
+
+PlyWriter::PlyWriter(const std::string& filename, glm::mat4 pos_transform)
+  : filename(filename), faces_filename(filename + ".faces"),
+    out(filename, std::ios::binary), faces_out(faces_filename, std::ios::binary),
+    pos_transform(pos_transform) {
+  if (!out)
+    throw std::runtime_error("Could not open " + filename);
+  if (!faces_out)
+    throw std::runtime_error("Could not open " + faces_filename);
+  out<<"ply\n";
+  out<<"format binary_little_endian 1.0\n";
+  out<<"element vertex ";
+  vertex_count_pos = out.tellp();
+  put_count(out, 0);
+  out<<"\n";
+  out<<"property float x\n";
+  out<<"property float y\n";
+  out<<"property float z\n";
+  out<<"property float nx\n";
+  out<<"property float ny\n";
+  out<<"property float nz\n";
+  out<<"property uchar red\n";
+  out<<"property uchar green\n";
+  out<<"property uchar blue\n";
+  out<<"element face ";
+  face_count_pos = out.tellp();
+  put_count(out, 0);
+  out<<"\n";
+  out<<"property list uchar int vertex_index\n";
+  out<<"end_header\n";
+  buffer.reserve(flush_bytes+vertex_bytes);
+  faces_buffer.reserve(flush_bytes+face_bytes);
+}
+
+PlyWriter::~PlyWriter(){
+  if (closed) return;
+  faces_out.close();
+  std::error_code ec;
+  std::filesystem::remove(faces_filename, ec);
+}
+
+void PlyWriter::write_vertices(std::span<const Vertex> vertices){
+  for (const Vertex& vertex : vertices){
+    glm::vec3 pos = pos_transform*glm::vec4(vertex.position,1.f);
+    glm::vec3 normal = vertex.normal;
+    glm::vec3 col = vertex.color;
+    if (glm::any(glm::isnan(normal))) normal = glm::vec3();
+    size_t at = buffer.size();
+    buffer.resize(at+vertex_bytes);
+    char* dst = buffer.data()+at;
+    dst = put(dst, pos.x); dst = put(dst, pos.y); dst = put(dst, pos.z);
+    dst = put(dst, normal.x); dst = put(dst, normal.y); dst = put(dst, normal.z);
+    dst = put(dst, (uint8_t)(col.r*255));
+    dst = put(dst, (uint8_t)(col.g*255));
+    dst = put(dst, (uint8_t)(col.b*255));
+    if (buffer.size() >= flush_bytes) flush();
+  }
+  num_vertices += vertices.size();
+}
+
+void PlyWriter::write_faces(std::span<const GLuint> indices){
+  for (size_t i=0; i+2<indices.size(); i+=3){
+    size_t at = faces_buffer.size();
+    faces_buffer.resize(at+face_bytes);
+    char* dst = faces_buffer.data()+at;
+    dst = put(dst, (uint8_t)3);
+    for (int c=0; c<3; c++) dst = put(dst, (int32_t)indices[i+c]);
+    if (faces_buffer.size() >= flush_bytes) flush();
+  }
+  num_faces += indices.size()/3;
+}
+
+void PlyWriter::flush(){
+  out.write(buffer.data(), buffer.size());
+  buffer.clear();
+  faces_out.write(faces_buffer.data(), faces_buffer.size());
+  faces_buffer.clear();
+}
+
+void PlyWriter::close(){
+  flush();
+  faces_out.close();
+  if (!faces_out)
+    throw std::runtime_error("Could not write " + faces_filename);
+  // Faces follow every vertex in the file
+  {
+    std::ifstream faces_in(faces_filename, std::ios::binary);
+    buffer.resize(flush_bytes);
+    while (faces_in.read(buffer.data(), buffer.size()) || faces_in.gcount() > 0)
+      out.write(buffer.data(), faces_in.gcount());
+    buffer.clear();
+  }
+  out.seekp(vertex_count_pos);
+  put_count(out, num_vertices);
+  out.seekp(face_count_pos);
+  put_count(out, num_faces);
+  out.close();
+  if (!out)
+    throw std::runtime_error("Could not write " + filename);
+  std::filesystem::remove(faces_filename);
+  closed = true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "rendering/VBO.h"
+
+// Binary little endian PLY, written as it comes in. Counts don't need to be
+// known up front, the header gets fixed width placeholders that close()
+// fills in. Vertices go straight to the file and faces to a sidecar file
+// (<filename>.faces) that is appended at the end, so vertices and faces can
+// be written in any order.
+class PlyWriter {
+public:
+  PlyWriter(const std::string& filename, glm::mat4 pos_transform = glm::mat4(1));
+  PlyWriter(const PlyWriter&) = delete;
+  PlyWriter& operator=(const PlyWriter&) = delete;
+  // Removes the sidecar file if close() was never reached
+  ~PlyWriter();
+
+  void write_vertices(std::span<const Vertex> vertices);
+  // Triangles, three indices each
+  void write_faces(std::span<const GLuint> indices);
+  // Throws if the file could not be written
+  void close();
+  size_t get_num_vertices() const { return num_vertices; }
+  size_t get_num_faces() const { return num_faces; }
+private:
+  std::string filename, faces_filename;
+  std::ofstream out, faces_out;
+  glm::mat4 pos_transform;
+  size_t num_vertices = 0, num_faces = 0;
+  // Where the count placeholders start in the header
+  std::streampos vertex_count_pos, face_count_pos;
+  std::vector<char> buffer, faces_buffer;
+  bool closed = false;
+  void flush();
+};
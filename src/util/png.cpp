@@ -0,0 +1,209 @@
+#include "util/png.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0){
+  static const std::array<uint32_t, 256> table = []{
+    std::array<uint32_t, 256> t;
+    for (uint32_t n=0; n<256; n++){
+      uint32_t c = n;
+      for (int k=0; k<8; k++) c = (c & 1) ? 0xedb88320u^(c>>1) : c>>1;
+      t[n] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t i=0; i<size; i++) crc = table[(crc^data[i]) & 0xff]^(crc>>8);
+  return ~crc;
+}
+
+uint32_t adler32(const std::vector<uint8_t>& data){
+  uint32_t a = 1, b = 0;
+  // 5552 bytes is the most that can be summed before b can overflow
+  for (size_t start=0; start<data.size(); start+=5552){
+    size_t end = std::min(data.size(), start+5552);
+    for (size_t i=start; i<end; i++){ a += data[i]; b += a; }
+    a %= 65521; b %= 65521;
+  }
+  return (b<<16) | a;
+}
+
+void put_u32(std::vector<uint8_t>& out, uint32_t v){
+  out.push_back(v>>24); out.push_back(v>>16); out.push_back(v>>8); out.push_back(v);
+}
+
+// Deflate stream bits go in least significant bit first
+struct BitWriter{
+  std::vector<uint8_t>& out;
+  uint64_t bits = 0;
+  int count = 0;
+  void put(uint32_t value, int n){
+    bits |= (uint64_t)value<<count;
+    count += n;
+    while (count >= 8){ out.push_back(bits); bits >>= 8; count -= 8; }
+  }
+  // Huffman codes are stored most significant bit first
+  void put_code(uint32_t code, int n){
+    uint32_t reversed = 0;
+    for (int i=0; i<n; i++) reversed |= ((code>>i) & 1)<<(n-1-i);
+    put(reversed, n);
+  }
+  void flush(){ if (count > 0) put(0, 8-count); }
+};
+
+constexpr uint16_t length_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+  35,43,51,59,67,83,99,115,131,163,195,227,258};
+constexpr uint8_t length_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,
+  3,3,3,3,4,4,4,4,5,5,5,5,0};
+constexpr uint16_t dist_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+  257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+constexpr uint8_t dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,
+  7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+void put_literal(BitWriter& bw, int symbol){
+  if (symbol < 144) bw.put_code(0x30+symbol, 8);
+  else if (symbol < 256) bw.put_code(0x190+symbol-144, 9);
+  else if (symbol < 280) bw.put_code(symbol-256, 7);
+  else bw.put_code(0xc0+symbol-280, 8);
+}
+
+void put_match(BitWriter& bw, int length, int distance){
+  int l = std::upper_bound(length_base, length_base+29, length)-length_base-1;
+  put_literal(bw, 257+l);
+  bw.put(length-length_base[l], length_extra[l]);
+  int d = std::upper_bound(dist_base, dist_base+30, distance)-dist_base-1;
+  bw.put_code(d, 5);
+  bw.put(distance-dist_base[d], dist_extra[d]);
+}
+
+// zlib stream of a single fixed Huffman block, greedy LZ77 over hash chains
+std::vector<uint8_t> zlib_compress(const std::vector<uint8_t>& data){
+  constexpr int window = 1<<15, max_match = 258, min_match = 3, max_chain = 32;
+  constexpr int hash_bits = 15;
+  std::vector<uint8_t> out = {0x78, 0x01};
+  BitWriter bw{out};
+  bw.put(1, 1); // final block
+  bw.put(1, 2); // fixed Huffman codes
+  std::vector<int32_t> head(1<<hash_bits, -1), prev(window, -1);
+  auto hash = [&](size_t i){
+    uint32_t v = data[i] | data[i+1]<<8 | data[i+2]<<16;
+    return (v*2654435761u)>>(32-hash_bits);
+  };
+  auto insert = [&](size_t i){
+    if (i+min_match > data.size()) return;
+    uint32_t h = hash(i);
+    prev[i & (window-1)] = head[h];
+    head[h] = i;
+  };
+  size_t i = 0;
+  while (i < data.size()){
+    int best_len = 0, best_dist = 0;
+    if (i+min_match <= data.size()){
+      int limit = std::min<size_t>(max_match, data.size()-i);
+      int32_t candidate = head[hash(i)];
+      for (int chain=0; chain<max_chain && candidate>=0 && i-candidate<=window; chain++){
+        int len = 0;
+        while (len < limit && data[candidate+len] == data[i+len]) len++;
+        if (len > best_len){ best_len = len; best_dist = i-candidate; }
+        if (len == limit) break;
+        int32_t next = prev[candidate & (window-1)];
+        if (next >= candidate) break; // slot reused by a newer position
+        candidate = next;
+      }
+    }
+    if (best_len >= min_match){
+      put_match(bw, best_len, best_dist);
+      for (int k=0; k<best_len; k++) insert(i+k);
+      i += best_len;
+    } else {
+      put_literal(bw, data[i]);
+      insert(i);
+      i++;
+    }
+  }
+  put_literal(bw, 256); // end of block
+  bw.flush();
+  put_u32(out, adler32(data));
+  return out;
+}
+
+uint8_t paeth(int a, int b, int c){
+  int p = a+b-c;
+  int pa = std::abs(p-a), pb = std::abs(p-b), pc = std::abs(p-c);
+  if (pa <= pb && pa <= pc) return a;
+  return pb <= pc ? b : c;
+}
+
+// Each row gets whichever filter leaves the smallest sum of residuals
+std::vector<uint8_t> filter_rows(int width, int height, std::span<const uint8_t> rgb){
+  const size_t stride = (size_t)width*3;
+  std::vector<uint8_t> filtered;
+  filtered.reserve((stride+1)*height);
+  std::vector<uint8_t> zero(stride, 0), trial(stride), best_row(stride);
+  for (int y=0; y<height; y++){
+    const uint8_t* row = rgb.data()+y*stride;
+    const uint8_t* up = y > 0 ? row-stride : zero.data();
+    int best = 0;
+    long best_cost = -1;
+    for (int type=0; type<5; type++){
+      for (size_t x=0; x<stride; x++){
+        int left = x >= 3 ? row[x-3] : 0;
+        int upleft = x >= 3 ? up[x-3] : 0;
+        uint8_t predict = 0;
+        switch (type){
+          case 1: predict = left; break;
+          case 2: predict = up[x]; break;
+          case 3: predict = (left+up[x])/2; break;
+          case 4: predict = paeth(left, up[x], upleft); break;
+        }
+        trial[x] = row[x]-predict;
+      }
+      long cost = 0;
+      for (uint8_t v : trial) cost += v < 128 ? v : 256-v;
+      if (best_cost < 0 || cost < best_cost){
+        best_cost = cost;
+        best = type;
+        best_row = trial;
+      }
+    }
+    filtered.push_back(best);
+    filtered.insert(filtered.end(), best_row.begin(), best_row.end());
+  }
+  return filtered;
+}
+
+void write_chunk(std::ofstream& out, const char* type, const std::vector<uint8_t>& data){
+  std::vector<uint8_t> chunk;
+  put_u32(chunk, data.size());
+  chunk.insert(chunk.end(), type, type+4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  put_u32(chunk, crc32(chunk.data()+4, chunk.size()-4));
+  out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+}
+
+void write_png(const std::string& filename, int width, int height,
+    std::span<const uint8_t> rgb){
+  if (rgb.size() != (size_t)width*height*3)
+    throw std::invalid_argument("PNG pixel data does not match its size");
+  std::ofstream out(filename, std::ios::binary);
+  if (!out)
+    throw std::runtime_error("Could not open " + filename);
+  const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  out.write(reinterpret_cast<const char*>(signature), 8);
+  std::vector<uint8_t> header;
+  put_u32(header, width);
+  put_u32(header, height);
+  header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bit RGB, not interlaced
+  write_chunk(out, "IHDR", header);
+  write_chunk(out, "IDAT", zlib_compress(filter_rows(width, height, rgb)));
+  write_chunk(out, "IEND", {});
+  if (!out)
+    throw std::runtime_error("Could not write " + filename);
+}
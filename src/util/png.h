@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+// Writes 8 bit RGB pixels, rows top to bottom, as a PNG. Compressed in
+// process (fixed Huffman deflate), throws if the file can't be written.
+void write_png(const std::string& filename, int width, int height,
+    std::span<const uint8_t> rgb);
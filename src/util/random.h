@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+// Counter based random numbers. Every (key, counter) pair always maps to the
+// same value, so draws can be made in any order and from any thread.
+inline uint64_t splitmix64(uint64_t x){
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+class CounterRng{
+    public:
+        explicit CounterRng(uint64_t key) : key(splitmix64(key)) {}
+        CounterRng(uint64_t a, uint64_t b) : CounterRng(splitmix64(a) ^ b) {}
+
+        uint64_t operator()(uint64_t counter) const {
+            return splitmix64(key ^ splitmix64(counter));
+        }
+        // Uniform float in [0,1)
+        float uniform(uint64_t counter) const {
+            return (float)((*this)(counter) >> 40) * 0x1p-24f;
+        }
+    private:
+        uint64_t key;
+};
@@ -9,6 +9,7 @@ void Stopwatch::stop(){
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time-start_time);
     int total = duration.count();
+    last_seconds = total/1e6;
     int second = total/1000000;
     int milli = total/1000-second*1000;
     int micro = total%1000;
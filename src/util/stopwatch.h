@@ -10,7 +10,10 @@ class Stopwatch{
     public:
         void start();
         void stop();
+        // Length of the last timed section
+        double seconds() const { return last_seconds; }
 
     private:
+        double last_seconds = 0.0;
         std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
 };
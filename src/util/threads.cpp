@@ -0,0 +1,73 @@
+#include "util/threads.h"
+
+#include <charconv>
+#include <stdexcept>
+#include <vector>
+
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+// Taken before any thread is pinned, so None can undo the pinning
+const cpu_set_t& allowed_cpus(){
+  static const cpu_set_t allowed = []{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0){
+      for (int cpu=0; cpu<omp_get_num_procs() && cpu<CPU_SETSIZE; cpu++) CPU_SET(cpu, &set);
+    }
+    return set;
+  }();
+  return allowed;
+}
+}
+
+Affinity parse_affinity(const std::string& name){
+  if (name == "none") return Affinity::None;
+  if (name == "close") return Affinity::Close;
+  if (name == "spread") return Affinity::Spread;
+  throw std::invalid_argument("Unknown thread affinity '" + name + "' (none, close or spread)");
+}
+
+int parse_thread_count(const std::string& value){
+  int count = 0;
+  const char* end = value.data()+value.size();
+  auto [ptr, ec] = std::from_chars(value.data(), end, count);
+  if (ec != std::errc() || ptr != end || count < 0)
+    throw std::invalid_argument("Expected a count of 0 or more, got '" + value + "'");
+  return count;
+}
+
+std::string to_string(Affinity affinity){
+  switch (affinity){
+    case Affinity::Close: return "close";
+    case Affinity::Spread: return "spread";
+    default: return "none";
+  }
+}
+
+int hardware_threads(){
+  return CPU_COUNT(&allowed_cpus());
+}
+
+void set_threads(int threads, Affinity affinity){
+  const cpu_set_t& allowed = allowed_cpus();
+  if (threads > 0) omp_set_num_threads(threads);
+  std::vector<int> cpus;
+  for (int cpu=0; cpu<CPU_SETSIZE; cpu++){
+    if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+  }
+  if (cpus.empty()) return;
+  #pragma omp parallel
+  {
+    int t = omp_get_thread_num(), n = omp_get_num_threads();
+    cpu_set_t set = allowed;
+    if (affinity != Affinity::None){
+      size_t slot = affinity == Affinity::Close ? t : (size_t)t*cpus.size()/n;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[slot % cpus.size()], &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+// Where OpenMP threads run. Close packs them onto neighbouring cores, spread
+// spaces them evenly over the cores this process is allowed to use.
+enum class Affinity { None, Close, Spread };
+// Throws std::invalid_argument for anything but none/close/spread
+Affinity parse_affinity(const std::string& name);
+// Thread or job count given on the command line. Throws
+// std::invalid_argument for anything but a whole number >= 0
+int parse_thread_count(const std::string& value);
+std::string to_string(Affinity affinity);
+
+// Cores this process is allowed to run on
+int hardware_threads();
+// Sets the OpenMP thread count of the calling thread, 0 keeps the default
+// (OMP_NUM_THREADS or every core), then pins the team's threads. OpenMP
+// reuses those threads for later teams of the same size.
+void set_threads(int threads, Affinity affinity = Affinity::None);